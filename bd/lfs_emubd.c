@@ -129,6 +129,8 @@ int lfs_emubd_createcfg(const struct lfs_config *cfg, const char *path,
     bd->proged = 0;
     bd->erased = 0;
     bd->power_cycles = bd->cfg->power_cycles;
+    bd->queued_count = 0;
+    bd->time = 0;
     bd->disk = NULL;
 
     if (bd->cfg->disk_path) {
@@ -229,6 +231,67 @@ int lfs_emubd_destroy(const struct lfs_config *cfg) {
 
 // block device API
 
+static bool lfs_emubd_isqueued(const lfs_emubd_t *bd, lfs_block_t block) {
+    for (lfs_size_t i = 0; i < bd->queued_count; i++) {
+        if (bd->queued[i] == block) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// simulated time of a read/prog, setup time plus transfer time
+static lfs_emubd_time_t lfs_emubd_xfertime(lfs_emubd_time_t time,
+        uint64_t bandwidth, lfs_size_t size) {
+    if (bandwidth) {
+        time += ((lfs_emubd_time_t)size*1000000000) / bandwidth;
+    }
+    return time;
+}
+
+// Advance the simulated clock by an op that occupies the device. Submitted
+// erases run one at a time, and an op can't overlap the running erase, so
+// it either waits for the erase to finish or suspends it. Erases queued
+// behind are pushed back by the op either way.
+static void lfs_emubd_tick(lfs_emubd_t *bd,
+        lfs_emubd_time_t time, bool suspend) {
+    // find the running erase, this is the first one to finish
+    bool running = false;
+    lfs_emubd_time_t done = 0;
+    for (lfs_size_t i = 0; i < bd->queued_count; i++) {
+        if (bd->queued_done[i] > bd->time
+                && (!running || bd->queued_done[i] < done)) {
+            running = true;
+            done = bd->queued_done[i];
+        }
+    }
+
+    if (!running) {
+        bd->time += time;
+        return;
+    }
+
+    if (suspend) {
+        // suspend the running erase, everything is pushed back
+        time += bd->cfg->suspend_time;
+        for (lfs_size_t i = 0; i < bd->queued_count; i++) {
+            if (bd->queued_done[i] > bd->time) {
+                bd->queued_done[i] += time;
+            }
+        }
+        bd->time += time;
+    } else {
+        // wait for the running erase, later erases wait for us
+        for (lfs_size_t i = 0; i < bd->queued_count; i++) {
+            if (bd->queued_done[i] > done) {
+                bd->queued_done[i] += time;
+            }
+        }
+        bd->time = done + time;
+    }
+}
+
 int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
         lfs_off_t off, void *buffer, lfs_size_t size) {
     LFS_EMUBD_TRACE("lfs_emubd_read(%p, "
@@ -238,6 +301,7 @@ int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
 
     // check if read is valid
     LFS_ASSERT(block < cfg->block_count);
+    LFS_ASSERT(!lfs_emubd_isqueued(bd, block));
     LFS_ASSERT(off  % cfg->read_size == 0);
     LFS_ASSERT(size % cfg->read_size == 0);
     LFS_ASSERT(off+size <= cfg->block_size);
@@ -263,6 +327,10 @@ int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
 
     // track reads
     bd->readed += size;
+    lfs_emubd_tick(bd,
+            lfs_emubd_xfertime(bd->cfg->read_time,
+                bd->cfg->read_bandwidth, size),
+            bd->cfg->erase_suspend);
     if (bd->cfg->read_sleep) {
         int err = nanosleep(&(struct timespec){
                 .tv_sec=bd->cfg->read_sleep/1000000000,
@@ -288,6 +356,7 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
 
     // check if write is valid
     LFS_ASSERT(block < cfg->block_count);
+    LFS_ASSERT(!lfs_emubd_isqueued(bd, block));
     LFS_ASSERT(off  % cfg->prog_size == 0);
     LFS_ASSERT(size % cfg->prog_size == 0);
     LFS_ASSERT(off+size <= cfg->block_size);
@@ -345,6 +414,10 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
 
     // track progs
     bd->proged += size;
+    lfs_emubd_tick(bd,
+            lfs_emubd_xfertime(bd->cfg->prog_time,
+                bd->cfg->prog_bandwidth, size),
+            bd->cfg->erase_suspend);
     if (bd->cfg->prog_sleep) {
         int err = nanosleep(&(struct timespec){
                 .tv_sec=bd->cfg->prog_sleep/1000000000,
@@ -361,7 +434,8 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
     if (bd->power_cycles > 0) {
         bd->power_cycles -= 1;
         if (bd->power_cycles == 0) {
-            // simulate power loss
+            // simulate power loss, this also loses any submitted erases
+            bd->queued_count = 0;
             bd->cfg->powerloss_cb(bd->cfg->powerloss_data);
         }
     }
@@ -370,13 +444,17 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
     return 0;
 }
 
-int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
+// erase without any simulated time, submitted erases have already been
+// accounted for by the time they are waited on
+static int lfs_emubd_rawerase(const struct lfs_config *cfg,
+        lfs_block_t block) {
     LFS_EMUBD_TRACE("lfs_emubd_erase(%p, 0x%"PRIx32" (%"PRIu32"))",
             (void*)cfg, block, cfg->block_size);
     lfs_emubd_t *bd = cfg->context;
 
     // check if erase is valid
     LFS_ASSERT(block < cfg->block_count);
+    LFS_ASSERT(!lfs_emubd_isqueued(bd, block));
 
     // get the block
     lfs_emubd_block_t *b = lfs_emubd_mutblock(cfg, &bd->blocks[block]);
@@ -447,7 +525,8 @@ int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
     if (bd->power_cycles > 0) {
         bd->power_cycles -= 1;
         if (bd->power_cycles == 0) {
-            // simulate power loss
+            // simulate power loss, this also loses any submitted erases
+            bd->queued_count = 0;
             bd->cfg->powerloss_cb(bd->cfg->powerloss_data);
         }
     }
@@ -456,6 +535,85 @@ int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
     return 0;
 }
 
+int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block) {
+    lfs_emubd_t *bd = cfg->context;
+    // erases never suspend other erases
+    lfs_emubd_tick(bd, bd->cfg->erase_time, false);
+    return lfs_emubd_rawerase(cfg, block);
+}
+
+int lfs_emubd_erase_range(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_size_t count) {
+    LFS_EMUBD_TRACE("lfs_emubd_erase_range(%p, 0x%"PRIx32", %"PRIu32")",
+            (void*)cfg, block, count);
+
+    // check if erase is valid
+    LFS_ASSERT(block + count <= cfg->block_count);
+
+    // erase each block, stopping at the first bad block
+    for (lfs_size_t i = 0; i < count; i++) {
+        int err = lfs_emubd_erase(cfg, block + i);
+        if (err) {
+            LFS_EMUBD_TRACE("lfs_emubd_erase_range -> %d", err);
+            return err;
+        }
+    }
+
+    LFS_EMUBD_TRACE("lfs_emubd_erase_range -> %d", 0);
+    return 0;
+}
+
+int lfs_emubd_erase_submit(const struct lfs_config *cfg, lfs_block_t block) {
+    LFS_EMUBD_TRACE("lfs_emubd_erase_submit(%p, 0x%"PRIx32")",
+            (void*)cfg, block);
+    lfs_emubd_t *bd = cfg->context;
+
+    // check if erase is valid
+    LFS_ASSERT(block < cfg->block_count);
+    LFS_ASSERT(!lfs_emubd_isqueued(bd, block));
+    LFS_ASSERT(bd->queued_count < LFS_EMUBD_QUEUE_SIZE);
+
+    // the erase is simulated when waited on, but starts as soon as any
+    // erases before it finish
+    lfs_emubd_time_t start = bd->time;
+    for (lfs_size_t i = 0; i < bd->queued_count; i++) {
+        start = lfs_max(start, bd->queued_done[i]);
+    }
+
+    bd->queued[bd->queued_count] = block;
+    bd->queued_done[bd->queued_count] = start + bd->cfg->erase_time;
+    bd->queued_count += 1;
+
+    LFS_EMUBD_TRACE("lfs_emubd_erase_submit -> %d", 0);
+    return 0;
+}
+
+int lfs_emubd_erase_wait(const struct lfs_config *cfg, lfs_block_t block) {
+    LFS_EMUBD_TRACE("lfs_emubd_erase_wait(%p, 0x%"PRIx32")",
+            (void*)cfg, block);
+    lfs_emubd_t *bd = cfg->context;
+
+    // find the submitted erase
+    lfs_size_t i = 0;
+    while (i < bd->queued_count && bd->queued[i] != block) {
+        i += 1;
+    }
+    LFS_ASSERT(i < bd->queued_count);
+
+    // wait for it to finish
+    bd->time = lfs_max(bd->time, bd->queued_done[i]);
+
+    bd->queued_count -= 1;
+    memmove(&bd->queued[i], &bd->queued[i+1],
+            (bd->queued_count - i) * sizeof(lfs_block_t));
+    memmove(&bd->queued_done[i], &bd->queued_done[i+1],
+            (bd->queued_count - i) * sizeof(lfs_emubd_time_t));
+
+    int err = lfs_emubd_rawerase(cfg, block);
+    LFS_EMUBD_TRACE("lfs_emubd_erase_wait -> %d", err);
+    return err;
+}
+
 int lfs_emubd_sync(const struct lfs_config *cfg) {
     LFS_EMUBD_TRACE("lfs_emubd_sync(%p)", (void*)cfg);
 
@@ -543,6 +701,13 @@ lfs_emubd_sio_t lfs_emubd_erased(const struct lfs_config *cfg) {
     return bd->erased;
 }
 
+lfs_emubd_stime_t lfs_emubd_time(const struct lfs_config *cfg) {
+    LFS_EMUBD_TRACE("lfs_emubd_time(%p)", (void*)cfg);
+    lfs_emubd_t *bd = cfg->context;
+    LFS_EMUBD_TRACE("lfs_emubd_time -> %"PRIu64, bd->time);
+    return bd->time;
+}
+
 int lfs_emubd_setreaded(const struct lfs_config *cfg, lfs_emubd_io_t readed) {
     LFS_EMUBD_TRACE("lfs_emubd_setreaded(%p, %"PRIu64")", (void*)cfg, readed);
     lfs_emubd_t *bd = cfg->context;
@@ -567,6 +732,14 @@ int lfs_emubd_seterased(const struct lfs_config *cfg, lfs_emubd_io_t erased) {
     return 0;
 }
 
+int lfs_emubd_settime(const struct lfs_config *cfg, lfs_emubd_time_t time) {
+    LFS_EMUBD_TRACE("lfs_emubd_settime(%p, %"PRIu64")", (void*)cfg, time);
+    lfs_emubd_t *bd = cfg->context;
+    bd->time = time;
+    LFS_EMUBD_TRACE("lfs_emubd_settime -> %d", 0);
+    return 0;
+}
+
 lfs_emubd_swear_t lfs_emubd_wear(const struct lfs_config *cfg,
         lfs_block_t block) {
     LFS_EMUBD_TRACE("lfs_emubd_wear(%p, %"PRIu32")", (void*)cfg, block);
@@ -650,6 +823,10 @@ int lfs_emubd_copy(const struct lfs_config *cfg, lfs_emubd_t *copy) {
     copy->proged = bd->proged;
     copy->erased = bd->erased;
     copy->power_cycles = bd->power_cycles;
+    memcpy(copy->queued, bd->queued, sizeof(bd->queued));
+    memcpy(copy->queued_done, bd->queued_done, sizeof(bd->queued_done));
+    copy->queued_count = bd->queued_count;
+    copy->time = bd->time;
     copy->disk = bd->disk;
     if (copy->disk) {
         copy->disk->rc += 1;
@@ -29,6 +29,11 @@ extern "C"
 #endif
 #endif
 
+// Maximum number of erases that can be submitted without being waited on
+#ifndef LFS_EMUBD_QUEUE_SIZE
+#define LFS_EMUBD_QUEUE_SIZE 64
+#endif
+
 // Mode determining how "bad-blocks" behave during testing. This simulates
 // some real-world circumstances such as progs not sticking (prog-noop),
 // a readonly disk (erase-noop), and ECC failures (read-error).
@@ -65,6 +70,10 @@ typedef int32_t lfs_emubd_spowercycles_t;
 typedef uint64_t lfs_emubd_sleep_t;
 typedef int64_t lfs_emubd_ssleep_t;
 
+// Type for simulated time in nanoseconds
+typedef uint64_t lfs_emubd_time_t;
+typedef int64_t lfs_emubd_stime_t;
+
 // emubd config, this is required for testing
 struct lfs_emubd_config {
     // 8-bit erase value to use for simulating erases. -1 does not simulate
@@ -113,6 +122,35 @@ struct lfs_emubd_config {
     // Artificial delay in nanoseconds, there is no purpose for this other
     // than slowing down the simulation.
     lfs_emubd_sleep_t erase_sleep;
+
+    // Simulated time in nanoseconds to set up a read, charged once per read
+    // call. This and the other timing fields only advance the simulated
+    // clock returned by lfs_emubd_time, they never actually delay.
+    lfs_emubd_time_t read_time;
+
+    // Simulated read bandwidth in bytes per second. Zero makes the transfer
+    // itself free, so every read costs read_time.
+    uint64_t read_bandwidth;
+
+    // Simulated time in nanoseconds to set up a prog, charged once per prog
+    // call.
+    lfs_emubd_time_t prog_time;
+
+    // Simulated prog bandwidth in bytes per second. Zero makes the transfer
+    // itself free, so every prog costs prog_time.
+    uint64_t prog_bandwidth;
+
+    // Simulated time in nanoseconds to erase a block. Submitted erases run
+    // in the background, one at a time, and block reads and progs until
+    // they finish unless the device can suspend them.
+    lfs_emubd_time_t erase_time;
+
+    // True if a running erase can be suspended to let a read or prog through.
+    // The erase is pushed back by the op plus suspend_time.
+    bool erase_suspend;
+
+    // Simulated time in nanoseconds to suspend and resume an erase.
+    lfs_emubd_time_t suspend_time;
 };
 
 // A reference counted block
@@ -142,6 +180,14 @@ typedef struct lfs_emubd {
     lfs_emubd_powercycles_t power_cycles;
     lfs_emubd_disk_t *disk;
 
+    // erases submitted but not yet waited on, and when they finish
+    lfs_block_t queued[LFS_EMUBD_QUEUE_SIZE];
+    lfs_emubd_time_t queued_done[LFS_EMUBD_QUEUE_SIZE];
+    lfs_size_t queued_count;
+
+    // simulated clock
+    lfs_emubd_time_t time;
+
     const struct lfs_emubd_config *cfg;
 } lfs_emubd_t;
 
@@ -175,6 +221,19 @@ int lfs_emubd_prog(const struct lfs_config *cfg, lfs_block_t block,
 // state of an erased block is undefined.
 int lfs_emubd_erase(const struct lfs_config *cfg, lfs_block_t block);
 
+// Erase a range of blocks
+int lfs_emubd_erase_range(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_size_t count);
+
+// Submit an erase of a block
+//
+// The erase only happens once it is waited on, any access to the block in
+// the meantime is an error. Submitted erases are lost on power-loss.
+int lfs_emubd_erase_submit(const struct lfs_config *cfg, lfs_block_t block);
+
+// Wait for a submitted erase to complete
+int lfs_emubd_erase_wait(const struct lfs_config *cfg, lfs_block_t block);
+
 // Sync the block device
 int lfs_emubd_sync(const struct lfs_config *cfg);
 
@@ -206,6 +265,12 @@ int lfs_emubd_setproged(const struct lfs_config *cfg, lfs_emubd_io_t proged);
 // Manually set amount of bytes erased
 int lfs_emubd_seterased(const struct lfs_config *cfg, lfs_emubd_io_t erased);
 
+// Get the simulated time in nanoseconds, see read_time/prog_time/erase_time
+lfs_emubd_stime_t lfs_emubd_time(const struct lfs_config *cfg);
+
+// Manually set the simulated time in nanoseconds
+int lfs_emubd_settime(const struct lfs_config *cfg, lfs_emubd_time_t time);
+
 // Get simulated wear on a given block
 lfs_emubd_swear_t lfs_emubd_wear(const struct lfs_config *cfg,
         lfs_block_t block);
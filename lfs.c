@@ -13,12 +13,46 @@
 #define LFS_BLOCK_NULL ((lfs_block_t)-1)
 #define LFS_BLOCK_INLINE ((lfs_block_t)-2)
 
+// maximum number of files committed together by lfs_fs_sync_all
+#define LFS_SYNC_BATCH 8
+
+// runtime counters and events, only kept with LFS_STATS
+#ifdef LFS_STATS
+#define LFS_STAT(lfs, counter, n) ((lfs)->stats.counter += (n))
+#define LFS_EVENT(lfs, e) \
+    ((lfs)->cfg->event ? (lfs)->cfg->event((lfs)->cfg, e) : (void)0)
+#else
+#define LFS_STAT(lfs, counter, n) ((void)(lfs))
+#define LFS_EVENT(lfs, e) ((void)(lfs))
+#endif
+
 enum {
     LFS_OK_RELOCATED = 1,
     LFS_OK_DROPPED   = 2,
     LFS_OK_ORPHANED  = 3,
 };
 
+// states of the incremental lookahead scan, see lfs_fs_gc_step
+enum {
+    LFS_GC_IDLE     = 0,
+    LFS_GC_SCANNING = 1,
+    LFS_GC_READY    = 2,
+};
+
+// states of the directory name index, see lfs_nindex_find
+enum {
+    LFS_NINDEX_NONE  = 0,
+    LFS_NINDEX_VALID = 1,
+    LFS_NINDEX_FULL  = 2,
+};
+
+// states of the parent map, see lfs_pmap_parent
+enum {
+    LFS_PMAP_NONE  = 0,
+    LFS_PMAP_VALID = 1,
+    LFS_PMAP_FULL  = 2,
+};
+
 enum {
     LFS_CMP_EQ = 0,
     LFS_CMP_LT = 1,
@@ -41,6 +75,108 @@ static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     pcache->block = LFS_BLOCK_NULL;
 }
 
+// Move the rcache into the read cache pool, and if the pool has a copy of
+// block+off move that copy into the rcache. The pool is kept in most recently
+// used order, so the last entry is the one that gets evicted.
+static bool lfs_cache_swap(lfs_t *lfs, lfs_block_t block, lfs_off_t off) {
+    lfs_cache_t *pool = lfs->rcaches;
+    lfs_size_t count = lfs->cfg->read_cache_count;
+
+    lfs_size_t i = 0;
+    for (; i < count; i++) {
+        if (block == pool[i].block &&
+                off >= pool[i].off &&
+                off < pool[i].off + pool[i].size) {
+            break;
+        }
+    }
+
+    bool hit = (i < count);
+    bool evict = (lfs->rcache.block != LFS_BLOCK_NULL
+            && lfs->rcache.size > 0);
+    if (!hit) {
+        if (!evict) {
+            return false;
+        }
+
+        i = count-1;
+    }
+
+    lfs_cache_t entry = pool[i];
+    if (hit && evict) {
+        // swap buffer contents, the pool's buffers are its own so we can't
+        // just swap pointers
+        lfs_size_t size = lfs_max(entry.size, lfs->rcache.size);
+        for (lfs_size_t j = 0; j < size; j++) {
+            uint8_t t = entry.buffer[j];
+            entry.buffer[j] = lfs->rcache.buffer[j];
+            lfs->rcache.buffer[j] = t;
+        }
+    } else if (hit) {
+        memcpy(lfs->rcache.buffer, entry.buffer, entry.size);
+    } else {
+        memcpy(entry.buffer, lfs->rcache.buffer, lfs->rcache.size);
+    }
+
+    lfs_cache_t rcache = lfs->rcache;
+    if (hit) {
+        lfs->rcache.block = entry.block;
+        lfs->rcache.off = entry.off;
+        lfs->rcache.size = entry.size;
+    }
+
+    // move to front
+    memmove(&pool[1], &pool[0], i*sizeof(lfs_cache_t));
+    if (evict) {
+        entry.block = rcache.block;
+        entry.off = rcache.off;
+        entry.size = rcache.size;
+        pool[0] = entry;
+    } else {
+        // nothing to evict, the entry is now free so move it to the back
+        memmove(&pool[0], &pool[1], (count-1)*sizeof(lfs_cache_t));
+        entry.block = LFS_BLOCK_NULL;
+        pool[count-1] = entry;
+    }
+
+    return hit;
+}
+
+#ifndef LFS_READONLY
+// Forget any cached copies of a block that is about to be programmed or
+// erased, the rcache itself may be aliased so we only empty it
+static void lfs_cache_discard(lfs_t *lfs, lfs_block_t block) {
+    if (lfs->readahead.cache.block == block) {
+        lfs_cache_drop(lfs, &lfs->readahead.cache);
+    }
+
+    if (!lfs->cfg->read_cache_count) {
+        return;
+    }
+
+    if (lfs->rcache.block == block) {
+        lfs->rcache.size = 0;
+    }
+
+    for (lfs_size_t i = 0; i < lfs->cfg->read_cache_count; i++) {
+        if (lfs->rcaches[i].block == block) {
+            lfs_cache_drop(lfs, &lfs->rcaches[i]);
+        }
+    }
+}
+#endif
+
+// Address of a block/offset in a memory-mapped device
+static inline const void *lfs_bd_mmap(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off) {
+    return (const uint8_t*)lfs->cfg->mmap_base
+            + (size_t)block*lfs->cfg->block_size + off;
+}
+
+// Under lfs_file_lockread's shared lock, reads must only ever pass a NULL
+// pcache and the file's own cache as rcache, so they only touch that cache.
+// Anything reaching shared state, the read cache pool, readahead, or the
+// runtime counters, is only safe under the exclusive lock
 static int lfs_bd_read(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
@@ -60,6 +196,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in pcache?
                 diff = lfs_min(diff, pcache->size - (off-pcache->off));
                 memcpy(data, &pcache->buffer[off-pcache->off], diff);
+                LFS_STAT(lfs, rcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -77,6 +214,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in rcache?
                 diff = lfs_min(diff, rcache->size - (off-rcache->off));
                 memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                LFS_STAT(lfs, rcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -88,10 +226,22 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, rcache->off-off);
         }
 
+        if (lfs->cfg->mmap_base) {
+            // memory-mapped device, copy straight out of the mapping
+            LFS_STAT(lfs, rcache_misses, 1);
+            memcpy(data, lfs_bd_mmap(lfs, block, off), diff);
+
+            data += diff;
+            off += diff;
+            size -= diff;
+            continue;
+        }
+
         if (size >= hint && off % lfs->cfg->read_size == 0 &&
                 size >= lfs->cfg->read_size) {
             // bypass cache?
             diff = lfs_aligndown(diff, lfs->cfg->read_size);
+            LFS_STAT(lfs, rcache_misses, 1);
             int err = lfs->cfg->read(lfs->cfg, block, off, data, diff);
             if (err) {
                 return err;
@@ -103,6 +253,12 @@ static int lfs_bd_read(lfs_t *lfs,
             continue;
         }
 
+        // in read cache pool?
+        if (rcache == &lfs->rcache && lfs->cfg->read_cache_count
+                && lfs_cache_swap(lfs, block, off)) {
+            continue;
+        }
+
         // load to cache, first condition can no longer fail
         LFS_ASSERT(block < lfs->cfg->block_count);
         rcache->block = block;
@@ -112,11 +268,16 @@ static int lfs_bd_read(lfs_t *lfs,
                     lfs_alignup(off+hint, lfs->cfg->read_size),
                     lfs->cfg->block_size)
                 - rcache->off,
-                lfs->cfg->cache_size);
+                (rcache == &lfs->readahead.cache)
+                    ? lfs->cfg->readahead_size
+                    : lfs->cfg->cache_size);
+        LFS_STAT(lfs, rcache_misses, 1);
         int err = lfs->cfg->read(lfs->cfg, rcache->block,
                 rcache->off, rcache->buffer, rcache->size);
         LFS_ASSERT(err <= 0);
         if (err) {
+            // don't leave a partially loaded cache around
+            lfs_cache_drop(lfs, rcache);
             return err;
         }
     }
@@ -178,6 +339,8 @@ static int lfs_bd_flush(lfs_t *lfs,
     if (pcache->block != LFS_BLOCK_NULL && pcache->block != LFS_BLOCK_INLINE) {
         LFS_ASSERT(pcache->block < lfs->cfg->block_count);
         lfs_size_t diff = lfs_alignup(pcache->size, lfs->cfg->prog_size);
+        lfs_cache_discard(lfs, pcache->block);
+        LFS_STAT(lfs, pcache_misses, 1);
         int err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
         LFS_ASSERT(err <= 0);
@@ -224,6 +387,7 @@ static int lfs_bd_sync(lfs_t *lfs,
 #endif
 
 #ifndef LFS_READONLY
+// Programs through the pcache, a NULL buffer programs zeros
 static int lfs_bd_prog(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache, bool validate,
         lfs_block_t block, lfs_off_t off,
@@ -239,15 +403,24 @@ static int lfs_bd_prog(lfs_t *lfs,
             // already fits in pcache?
             lfs_size_t diff = lfs_min(size,
                     lfs->cfg->cache_size - (off-pcache->off));
-            memcpy(&pcache->buffer[off-pcache->off], data, diff);
+            if (data) {
+                memcpy(&pcache->buffer[off-pcache->off], data, diff);
+                data += diff;
+            } else {
+                // no buffer, fill with zeros
+                memset(&pcache->buffer[off-pcache->off], 0, diff);
+            }
+            LFS_STAT(lfs, pcache_hits, 1);
 
-            data += diff;
             off += diff;
             size -= diff;
 
             pcache->size = lfs_max(pcache->size, off - pcache->off);
-            if (pcache->size == lfs->cfg->cache_size) {
-                // eagerly flush out pcache if we fill up
+            if (pcache->size == lfs->cfg->cache_size ||
+                    pcache->off + pcache->size == lfs->cfg->block_size) {
+                // eagerly flush out pcache if we fill up or reach the end
+                // of the block, the latter only happens when appending to
+                // a partially programmed block
                 int err = lfs_bd_flush(lfs, pcache, rcache, validate);
                 if (err) {
                     return err;
@@ -261,6 +434,41 @@ static int lfs_bd_prog(lfs_t *lfs,
         // entire block or manually flushing the pcache
         LFS_ASSERT(pcache->block == LFS_BLOCK_NULL);
 
+        // bypass pcache for large aligned runs? we keep to cache_size
+        // alignment so the pcache still fills up exactly at block end
+        if (lfs->cfg->prog_large && data && block != LFS_BLOCK_INLINE &&
+                off % lfs->cfg->cache_size == 0 &&
+                size > lfs->cfg->cache_size) {
+            lfs_size_t diff = lfs_aligndown(size, lfs->cfg->cache_size);
+            lfs_cache_discard(lfs, block);
+            LFS_STAT(lfs, pcache_misses, 1);
+            int err = lfs->cfg->prog_large(lfs->cfg, block, off, data, diff);
+            LFS_ASSERT(err <= 0);
+            if (err) {
+                return err;
+            }
+
+            if (validate) {
+                // check data on disk
+                lfs_cache_drop(lfs, rcache);
+                int res = lfs_bd_cmp(lfs,
+                        NULL, rcache, diff,
+                        block, off, data, diff);
+                if (res < 0) {
+                    return res;
+                }
+
+                if (res != LFS_CMP_EQ) {
+                    return LFS_ERR_CORRUPT;
+                }
+            }
+
+            data += diff;
+            off += diff;
+            size -= diff;
+            continue;
+        }
+
         // prepare pcache, first condition can no longer fail
         pcache->block = block;
         pcache->off = lfs_aligndown(off, lfs->cfg->prog_size);
@@ -271,15 +479,68 @@ static int lfs_bd_prog(lfs_t *lfs,
 }
 #endif
 
+#ifndef LFS_READONLY
+// forget any cached tags of a block that is about to be erased, programs
+// only ever append to a metadata log so they leave cached tags intact
+static void lfs_tcache_discard(lfs_t *lfs, lfs_block_t block) {
+    if (lfs->tcache.block == block) {
+        lfs->tcache.block = LFS_BLOCK_NULL;
+        lfs->tcache.count = 0;
+    }
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
     LFS_ASSERT(block < lfs->cfg->block_count);
+    lfs_cache_discard(lfs, block);
+    lfs_tcache_discard(lfs, block);
     int err = lfs->cfg->erase(lfs->cfg, block);
     LFS_ASSERT(err <= 0);
     return err;
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_bd_eraserange(lfs_t *lfs, lfs_block_t block, lfs_size_t count) {
+    LFS_ASSERT(block + count <= lfs->cfg->block_count);
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_cache_discard(lfs, block + i);
+        lfs_tcache_discard(lfs, block + i);
+    }
+
+    int err = lfs->cfg->erase_range(lfs->cfg, block, count);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_bd_erasesubmit(lfs_t *lfs, lfs_block_t block) {
+    LFS_ASSERT(block < lfs->cfg->block_count);
+    lfs_cache_discard(lfs, block);
+    lfs_tcache_discard(lfs, block);
+    if (!lfs->cfg->erase_submit) {
+        // synchronous block devices erase when we wait
+        return 0;
+    }
+
+    int err = lfs->cfg->erase_submit(lfs->cfg, block);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+
+static int lfs_bd_erasewait(lfs_t *lfs, lfs_block_t block) {
+    if (!lfs->cfg->erase_submit) {
+        return lfs_bd_erase(lfs, block);
+    }
+
+    int err = lfs->cfg->erase_wait(lfs->cfg, block);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+#endif
+
 
 /// Small type-level utilities ///
 // operations on block pairs
@@ -389,13 +650,13 @@ struct lfs_diskoff {
 
 // operations on global state
 static inline void lfs_gstate_xor(lfs_gstate_t *a, const lfs_gstate_t *b) {
-    for (int i = 0; i < 3; i++) {
+    for (size_t i = 0; i < sizeof(lfs_gstate_t)/sizeof(uint32_t); i++) {
         ((uint32_t*)a)[i] ^= ((const uint32_t*)b)[i];
     }
 }
 
 static inline bool lfs_gstate_iszero(const lfs_gstate_t *a) {
-    for (int i = 0; i < 3; i++) {
+    for (size_t i = 0; i < sizeof(lfs_gstate_t)/sizeof(uint32_t); i++) {
         if (((uint32_t*)a)[i] != 0) {
             return false;
         }
@@ -412,10 +673,11 @@ static inline uint8_t lfs_gstate_getorphans(const lfs_gstate_t *a) {
     return lfs_tag_size(a->tag) & 0x1ff;
 }
 
+#endif
+
 static inline bool lfs_gstate_hasmove(const lfs_gstate_t *a) {
     return lfs_tag_type1(a->tag) != 0;
 }
-#endif
 
 static inline bool lfs_gstate_needssuperblock(const lfs_gstate_t *a) {
     return lfs_tag_size(a->tag) >> 9;
@@ -426,17 +688,71 @@ static inline bool lfs_gstate_hasmovehere(const lfs_gstate_t *a,
     return lfs_tag_type1(a->tag) && lfs_pair_cmp(a->pair, pair) == 0;
 }
 
+// the free extent's checksum needs to be non-linear, otherwise xoring in a
+// lost delta could produce another valid checksum
+static inline uint32_t lfs_gstate_extentsum(const lfs_gstate_t *a) {
+    return (a->extent[0] * 0x9e3779b1) ^ (a->extent[1] * 0x85ebca77)
+            ^ 0x6c667865;
+}
+
+static inline bool lfs_gstate_hasextent(const lfs_gstate_t *a,
+        lfs_size_t block_count) {
+    return a->extent[1] != 0
+            && a->extent[0] < block_count
+            && a->extent[1] <= block_count
+            && a->esum == lfs_gstate_extentsum(a);
+}
+
+static inline void lfs_gstate_setextent(lfs_gstate_t *a,
+        lfs_block_t off, lfs_block_t size) {
+    a->extent[0] = (size) ? off : 0;
+    a->extent[1] = size;
+    a->esum = (size) ? lfs_gstate_extentsum(a) : 0;
+}
+
+// the free extent is only written if present, so the gstate stays
+// compatible with drivers that don't know about it
+static inline lfs_size_t lfs_gstate_size(const lfs_gstate_t *a) {
+    return (a->extent[0] || a->extent[1] || a->esum)
+            ? sizeof(lfs_gstate_t)
+            : 3*sizeof(uint32_t);
+}
+
 static inline void lfs_gstate_fromle32(lfs_gstate_t *a) {
-    a->tag     = lfs_fromle32(a->tag);
-    a->pair[0] = lfs_fromle32(a->pair[0]);
-    a->pair[1] = lfs_fromle32(a->pair[1]);
+    a->tag       = lfs_fromle32(a->tag);
+    a->pair[0]   = lfs_fromle32(a->pair[0]);
+    a->pair[1]   = lfs_fromle32(a->pair[1]);
+    a->extent[0] = lfs_fromle32(a->extent[0]);
+    a->extent[1] = lfs_fromle32(a->extent[1]);
+    a->esum      = lfs_fromle32(a->esum);
 }
 
 #ifndef LFS_READONLY
 static inline void lfs_gstate_tole32(lfs_gstate_t *a) {
-    a->tag     = lfs_tole32(a->tag);
-    a->pair[0] = lfs_tole32(a->pair[0]);
-    a->pair[1] = lfs_tole32(a->pair[1]);
+    a->tag       = lfs_tole32(a->tag);
+    a->pair[0]   = lfs_tole32(a->pair[0]);
+    a->pair[1]   = lfs_tole32(a->pair[1]);
+    a->extent[0] = lfs_tole32(a->extent[0]);
+    a->extent[1] = lfs_tole32(a->extent[1]);
+    a->esum      = lfs_tole32(a->esum);
+}
+#endif
+
+// checkpoint of the gstate written to the superblock on a clean unmount
+typedef struct lfs_checkpoint {
+    lfs_gstate_t gstate;
+    uint32_t seed;
+} lfs_checkpoint_t;
+
+static inline void lfs_checkpoint_fromle32(lfs_checkpoint_t *checkpoint) {
+    lfs_gstate_fromle32(&checkpoint->gstate);
+    checkpoint->seed = lfs_fromle32(checkpoint->seed);
+}
+
+#ifndef LFS_READONLY
+static inline void lfs_checkpoint_tole32(lfs_checkpoint_t *checkpoint) {
+    lfs_gstate_tole32(&checkpoint->gstate);
+    checkpoint->seed = lfs_tole32(checkpoint->seed);
 }
 #endif
 
@@ -519,7 +835,9 @@ static void lfs_mlist_append(lfs_t *lfs, struct lfs_mlist *mlist) {
 }
 
 // some other filesystem operations
-static uint32_t lfs_fs_disk_version(lfs_t *lfs) {
+
+// the newest version we can mount
+static uint32_t lfs_fs_disk_version_max(lfs_t *lfs) {
     (void)lfs;
 #ifdef LFS_MULTIVERSION
     if (lfs->cfg->disk_version) {
@@ -531,6 +849,21 @@ static uint32_t lfs_fs_disk_version(lfs_t *lfs) {
     }
 }
 
+// the version we write, we only need lfs2.2 for free extents and mount
+// checkpoints, and leave everything else mountable by lfs2.1 drivers
+static uint32_t lfs_fs_disk_version(lfs_t *lfs) {
+#ifdef LFS_MULTIVERSION
+    if (lfs->cfg->disk_version) {
+        return lfs->cfg->disk_version;
+    } else
+#endif
+    if (lfs->cfg->free_extent_step || lfs->cfg->mount_checkpoint) {
+        return 0x00020002;
+    } else {
+        return 0x00020001;
+    }
+}
+
 static uint16_t lfs_fs_disk_version_major(lfs_t *lfs) {
     return 0xffff & (lfs_fs_disk_version(lfs) >> 16);
 
@@ -540,6 +873,13 @@ static uint16_t lfs_fs_disk_version_minor(lfs_t *lfs) {
     return 0xffff & (lfs_fs_disk_version(lfs) >> 0);
 }
 
+// older drivers skip checkpoints and would write without dropping them,
+// so these need lfs2.2
+static bool lfs_fs_usecheckpoint(lfs_t *lfs) {
+    return lfs->cfg->mount_checkpoint
+            && lfs_fs_disk_version(lfs) >= 0x00020002;
+}
+
 
 /// Internal operations predeclared here ///
 static lfs_ssize_t lfs_dir_rawpath(lfs_t *lfs,
@@ -566,6 +906,8 @@ static int lfs_fs_pred(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *pdir);
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *parent);
+static int lfs_fs_desuperblock(lfs_t *lfs);
+static int lfs_fs_checkpoint(lfs_t *lfs);
 static int lfs_fs_forceconsistency(lfs_t *lfs);
 #endif
 
@@ -584,8 +926,9 @@ static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file);
 static lfs_soff_t lfs_file_rawsize(lfs_t *lfs, lfs_file_t *file);
+static int lfs_file_getcache(lfs_t *lfs, lfs_file_t *file);
 
-static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs);
+static lfs_ssize_t lfs_fs_rawsize_exact(lfs_t *lfs);
 static int lfs_fs_rawtraverse(lfs_t *lfs,
         int (*cb)(void *data, lfs_block_t block), void *data,
         bool includeorphans);
@@ -596,15 +939,29 @@ static int lfs_rawunmount(lfs_t *lfs);
 
 /// Block allocator ///
 #ifndef LFS_READONLY
-static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
-    lfs_t *lfs = (lfs_t*)p;
-    lfs_block_t off = ((block - lfs->free.off)
+static void lfs_alloc_mark(lfs_t *lfs, struct lfs_free *free,
+        lfs_block_t block) {
+    lfs_block_t off = ((block - free->off)
             + lfs->cfg->block_count) % lfs->cfg->block_count;
 
-    if (off < lfs->free.size) {
-        lfs->free.buffer[off / 32] |= 1U << (off % 32);
+    if (off < free->size) {
+        free->buffer[off / 32] |= 1U << (off % 32);
+    } else if (off - free->size < free->extent) {
+        // free extent ends at the first block in use
+        free->extent = off - free->size;
     }
+}
+
+static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    LFS_STAT(lfs, lookahead_blocks, 1);
+    lfs_alloc_mark(lfs, &lfs->free, block);
+    return 0;
+}
 
+static int lfs_alloc_gclookahead(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    lfs_alloc_mark(lfs, &lfs->gc.free, block);
     return 0;
 }
 #endif
@@ -621,11 +978,28 @@ static void lfs_alloc_ack(lfs_t *lfs) {
 static void lfs_alloc_drop(lfs_t *lfs) {
     lfs->free.size = 0;
     lfs->free.i = 0;
+    lfs->free.extent = 0;
+    lfs_gstate_setextent(&lfs->gstate, 0, 0);
     lfs_alloc_ack(lfs);
+    lfs->gc.state = LFS_GC_IDLE;
 }
 
 #ifndef LFS_READONLY
-static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+// free extents are recorded in the gstate, which older drivers would leave
+// untouched while allocating from them, so these need lfs2.2
+static bool lfs_alloc_useextents(lfs_t *lfs) {
+    return lfs->cfg->free_extent_step
+            && lfs_fs_disk_version(lfs) >= 0x00020002;
+}
+
+// keep our count of blocks in use up to date, if we have one
+static void lfs_alloc_used(lfs_t *lfs, lfs_ssize_t delta) {
+    if (lfs->used != LFS_BLOCK_NULL) {
+        lfs->used += delta;
+    }
+}
+
+static int lfs_alloc_scan(lfs_t *lfs, lfs_block_t *block) {
     while (true) {
         while (lfs->free.i != lfs->free.size) {
             lfs_block_t off = lfs->free.i;
@@ -645,105 +1019,382 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
                     lfs->free.ack -= 1;
                 }
 
+                lfs_alloc_used(lfs, +1);
                 return 0;
             }
         }
 
+        // allocate from the free extent following the lookahead?
+        if (lfs->free.extent > 0) {
+            lfs->free.off = (lfs->free.off + lfs->free.size)
+                    % lfs->cfg->block_count;
+            lfs->free.size = 0;
+            lfs->free.i = 0;
+
+            *block = lfs->free.off;
+            lfs->free.off = (lfs->free.off + 1) % lfs->cfg->block_count;
+            lfs->free.extent -= 1;
+            lfs->free.ack -= 1;
+
+            // blocks we hand out must leave the extent on disk, but move the
+            // extent in steps so we don't change gstate on every allocation
+            if (lfs->gstate.extent[1] > lfs->free.extent) {
+                lfs_block_t skip = lfs_min(lfs->free.extent,
+                        lfs->cfg->free_extent_step-1);
+                lfs_gstate_setextent(&lfs->gstate,
+                        (lfs->free.off + skip) % lfs->cfg->block_count,
+                        lfs->free.extent - skip);
+            }
+
+            lfs_alloc_used(lfs, +1);
+            return 0;
+        }
+
         // check if we have looked at all blocks since last ack
         if (lfs->free.ack == 0) {
-            LFS_ERROR("No more free space %"PRIu32,
-                    lfs->free.i + lfs->free.off);
             return LFS_ERR_NOSPC;
         }
 
+        // switch to the lookahead window prepared by lfs_fs_gc_step?
+        if (lfs->gc.state == LFS_GC_READY) {
+            uint32_t *buffer = lfs->free.buffer;
+            lfs->free.off = lfs->gc.free.off;
+            lfs->free.size = lfs_min(lfs->gc.free.size, lfs->free.ack);
+            lfs->free.i = 0;
+            lfs->free.extent = lfs_min(lfs->gc.free.extent,
+                    lfs->free.ack - lfs->free.size);
+            lfs->free.buffer = lfs->gc.free.buffer;
+            lfs->gc.free.buffer = buffer;
+            lfs->gc.state = LFS_GC_IDLE;
+
+            lfs_gstate_setextent(&lfs->gstate,
+                    (lfs->free.off + lfs->free.size) % lfs->cfg->block_count,
+                    lfs->free.extent);
+            continue;
+        }
+
+        // any incremental scan is relative to the current window, so it
+        // can't survive us replacing it
+        lfs->gc.state = LFS_GC_IDLE;
+
         lfs->free.off = (lfs->free.off + lfs->free.size)
                 % lfs->cfg->block_count;
         lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
         lfs->free.i = 0;
+        // also measure the free extent after the lookahead, limited to
+        // blocks we haven't looked at since the last ack
+        lfs->free.extent = (lfs_alloc_useextents(lfs))
+                ? lfs->free.ack - lfs->free.size
+                : 0;
 
         // find mask of free blocks from tree
         memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
+        LFS_STAT(lfs, lookahead_refills, 1);
+        LFS_EVENT(lfs, LFS_EVENT_ALLOC_BEGIN);
         int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, lfs, true);
+        LFS_EVENT(lfs, LFS_EVENT_ALLOC_END);
         if (err) {
             lfs_alloc_drop(lfs);
             return err;
         }
+
+        lfs_gstate_setextent(&lfs->gstate,
+                (lfs->free.off + lfs->free.size) % lfs->cfg->block_count,
+                lfs->free.extent);
     }
 }
-#endif
-
-/// Metadata pair and directory operations ///
-static lfs_stag_t lfs_dir_getslice(lfs_t *lfs, const lfs_mdir_t *dir,
-        lfs_tag_t gmask, lfs_tag_t gtag,
-        lfs_off_t goff, void *gbuffer, lfs_size_t gsize) {
-    lfs_off_t off = dir->off;
-    lfs_tag_t ntag = dir->etag;
-    lfs_stag_t gdiff = 0;
 
-    if (lfs_gstate_hasmovehere(&lfs->gdisk, dir->pair) &&
-            lfs_tag_id(gmask) != 0 &&
-            lfs_tag_id(lfs->gdisk.tag) <= lfs_tag_id(gtag)) {
-        // synthetic moves
-        gdiff -= LFS_MKTAG(0, 1, 0);
+static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+    int err = lfs_alloc_scan(lfs, block);
+    if (err != LFS_ERR_NOSPC) {
+        return err;
     }
 
-    // iterate over dir block backwards (for faster lookups)
-    while (off >= sizeof(lfs_tag_t) + lfs_tag_dsize(ntag)) {
-        off -= lfs_tag_dsize(ntag);
-        lfs_tag_t tag = ntag;
-        int err = lfs_bd_read(lfs,
-                NULL, &lfs->rcache, sizeof(ntag),
-                dir->pair[0], off, &ntag, sizeof(ntag));
-        if (err) {
-            return err;
+    // out of space, give back the most recently queued erase, our caller
+    // erases the block anyways
+    if (lfs->equeue.count > 0) {
+        lfs->equeue.count -= 1;
+        *block = lfs->equeue.buffer[
+                (lfs->equeue.off + lfs->equeue.count)
+                    % lfs->equeue.size];
+        if (lfs->equeue.erased > lfs->equeue.count) {
+            lfs->equeue.erased -= 1;
+            return 0;
         }
 
-        ntag = (lfs_frombe32(ntag) ^ tag) & 0x7fffffff;
+        err = lfs_bd_erasewait(lfs, *block);
+        if (err && err != LFS_ERR_CORRUPT) {
+            return err;
+        }
 
-        if (lfs_tag_id(gmask) != 0 &&
-                lfs_tag_type1(tag) == LFS_TYPE_SPLICE &&
-                lfs_tag_id(tag) <= lfs_tag_id(gtag - gdiff)) {
-            if (tag == (LFS_MKTAG(LFS_TYPE_CREATE, 0, 0) |
-                    (LFS_MKTAG(0, 0x3ff, 0) & (gtag - gdiff)))) {
-                // found where we were created
-                return LFS_ERR_NOENT;
-            }
+        return 0;
+    }
 
-            // move around splices
-            gdiff += LFS_MKTAG(0, lfs_tag_splice(tag), 0);
+    // then the end of any blocks reserved for files
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type == LFS_TYPE_REG && f->extent.count > 0) {
+            f->extent.count -= 1;
+            *block = f->extent.block + f->extent.count;
+            return 0;
         }
+    }
 
-        if ((gmask & tag) == (gmask & (gtag - gdiff))) {
-            if (lfs_tag_isdelete(tag)) {
-                return LFS_ERR_NOENT;
-            }
+    LFS_ERROR("No more free space %"PRIu32,
+            lfs->free.i + lfs->free.off);
+    return LFS_ERR_NOSPC;
+}
 
-            lfs_size_t diff = lfs_min(lfs_tag_size(tag), gsize);
-            err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, diff,
-                    dir->pair[0], off+sizeof(tag)+goff, gbuffer, diff);
+// reserve a run of up to count contiguous free blocks, we search what's
+// left of the lookahead window for the first run of count blocks, or the
+// longest run we can find
+static int lfs_alloc_extent(lfs_t *lfs, lfs_size_t count,
+        struct lfs_extent *extent) {
+    // find the next free block, this moves the window along if we need to
+    extent->count = 0;
+    lfs_block_t block;
+    int err = lfs_alloc_scan(lfs, &block);
+    if (err) {
+        return err;
+    }
+
+    lfs_block_t start = ((block - lfs->free.off)
+            + lfs->cfg->block_count) % lfs->cfg->block_count;
+    if (start >= lfs->free.size) {
+        // block came from the free extent after the window, which is
+        // contiguous up until the end of the disk
+        extent->block = block;
+        extent->count = 1;
+        while (extent->count < count
+                && lfs->free.extent > 0
+                && lfs->free.off == extent->block + extent->count) {
+            err = lfs_alloc_scan(lfs, &block);
             if (err) {
                 return err;
             }
 
-            memset((uint8_t*)gbuffer + diff, 0, gsize - diff);
+            extent->count += 1;
+        }
 
-            return tag + gdiff;
+        return 0;
+    }
+
+    // rewind the window to our block so the search starts there
+    lfs->free.ack += lfs->free.i - start;
+    lfs->free.i = start;
+
+    lfs_block_t best = start;
+    lfs_size_t bestcount = 0;
+    for (lfs_block_t off = start;
+            off < lfs->free.size && bestcount < count;
+            off++) {
+        if (lfs->free.buffer[off / 32] & (1U << (off % 32))) {
+            start = off+1;
+            continue;
+        }
+
+        // runs can't wrap around the end of the disk
+        if ((lfs->free.off + off) % lfs->cfg->block_count == 0) {
+            start = off;
+        }
+
+        if (off+1 - start > bestcount) {
+            best = start;
+            bestcount = off+1 - start;
         }
     }
 
-    return LFS_ERR_NOENT;
-}
+    // mark the run as in use, the file keeps it reserved after this, our
+    // first block may be handed out again if it isn't part of the run
+    for (lfs_block_t off = best; off < best + bestcount; off++) {
+        lfs->free.buffer[off / 32] |= 1U << (off % 32);
+    }
+    lfs_alloc_used(lfs, (lfs_ssize_t)bestcount - 1);
 
-static lfs_stag_t lfs_dir_get(lfs_t *lfs, const lfs_mdir_t *dir,
-        lfs_tag_t gmask, lfs_tag_t gtag, void *buffer) {
-    return lfs_dir_getslice(lfs, dir,
-            gmask, gtag,
-            0, buffer, lfs_tag_size(gtag));
+    extent->block = (lfs->free.off + best) % lfs->cfg->block_count;
+    extent->count = bestcount;
+    return 0;
 }
 
-static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
-        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
+// fill the erase queue up to size, this only fails with LFS_ERR_NOSPC if
+// the queue is left empty
+static int lfs_alloc_erasefill(lfs_t *lfs, lfs_size_t size) {
+    while (lfs->equeue.count < size) {
+        lfs_block_t block;
+        int err = (lfs->equeue.count > 0)
+                ? lfs_alloc_scan(lfs, &block)
+                : lfs_alloc(lfs, &block);
+        if (err == LFS_ERR_NOSPC && lfs->equeue.count > 0) {
+            return 0;
+        } else if (err) {
+            return err;
+        }
+
+        err = lfs_bd_erasesubmit(lfs, block);
+        if (err) {
+            return err;
+        }
+
+        lfs->equeue.buffer[
+                (lfs->equeue.off + lfs->equeue.count)
+                    % lfs->equeue.size] = block;
+        lfs->equeue.count += 1;
+    }
+
+    return 0;
+}
+
+// allocate a block with its erase submitted, unless erased is set the
+// erase must be finished with lfs_bd_erasewait
+//
+// with an erase queue we hand out the oldest queued block, the queue has
+// room for one extra block so the erase of its replacement is submitted
+// while our block is still reserved, the next erase then runs while the
+// caller programs this block
+static int lfs_alloc_erasing(lfs_t *lfs, lfs_block_t *block, bool *erased) {
+    *erased = false;
+    if (!lfs->cfg->erase_queue_depth) {
+        int err = lfs_alloc(lfs, block);
+        if (err) {
+            return err;
+        }
+
+        return lfs_bd_erasesubmit(lfs, *block);
+    }
+
+    int err = lfs_alloc_erasefill(lfs, lfs->equeue.size);
+    if (err) {
+        return err;
+    }
+
+    // blocks erased by lfs_fs_preerase are ready to go
+    *block = lfs->equeue.buffer[lfs->equeue.off];
+    lfs->equeue.off = (lfs->equeue.off + 1) % lfs->equeue.size;
+    lfs->equeue.count -= 1;
+    if (lfs->equeue.erased > 0) {
+        lfs->equeue.erased -= 1;
+        *erased = true;
+    }
+    return 0;
+}
+
+// like lfs_alloc_erasing, but take blocks from a reserved extent first
+//
+// we also count the blocks taken here, the file gives back any it no longer
+// needs once synced
+static int lfs_alloc_extending(lfs_t *lfs, struct lfs_extent *extent,
+        lfs_block_t *block, bool *erased) {
+    if (extent->count == 0) {
+        int err = lfs_alloc_erasing(lfs, block, erased);
+        if (err) {
+            return err;
+        }
+
+        extent->taken += 1;
+        return 0;
+    }
+
+    *block = extent->block;
+    *erased = false;
+    extent->block += 1;
+    extent->count -= 1;
+    extent->taken += 1;
+    return lfs_bd_erasesubmit(lfs, *block);
+}
+
+// wait on any queued erases, these blocks are freed when we unmount
+static int lfs_alloc_erasedrain(lfs_t *lfs) {
+    int err = 0;
+    while (lfs->equeue.count > 0) {
+        if (lfs->equeue.erased > 0) {
+            lfs->equeue.erased -= 1;
+        } else {
+            int err2 = lfs_bd_erasewait(lfs,
+                    lfs->equeue.buffer[lfs->equeue.off]);
+            if (err2 && err2 != LFS_ERR_CORRUPT && !err) {
+                err = err2;
+            }
+        }
+
+        lfs->equeue.off = (lfs->equeue.off + 1) % lfs->equeue.size;
+        lfs->equeue.count -= 1;
+    }
+
+    return err;
+}
+#endif
+
+/// Metadata pair and directory operations ///
+static lfs_stag_t lfs_dir_getslice(lfs_t *lfs, const lfs_mdir_t *dir,
+        lfs_tag_t gmask, lfs_tag_t gtag,
+        lfs_off_t goff, void *gbuffer, lfs_size_t gsize) {
+    lfs_off_t off = dir->off;
+    lfs_tag_t ntag = dir->etag;
+    lfs_stag_t gdiff = 0;
+
+    if (lfs_gstate_hasmovehere(&lfs->gdisk, dir->pair) &&
+            lfs_tag_id(gmask) != 0 &&
+            lfs_tag_id(lfs->gdisk.tag) <= lfs_tag_id(gtag)) {
+        // synthetic moves
+        gdiff -= LFS_MKTAG(0, 1, 0);
+    }
+
+    // iterate over dir block backwards (for faster lookups)
+    while (off >= sizeof(lfs_tag_t) + lfs_tag_dsize(ntag)) {
+        off -= lfs_tag_dsize(ntag);
+        lfs_tag_t tag = ntag;
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(ntag),
+                dir->pair[0], off, &ntag, sizeof(ntag));
+        if (err) {
+            return err;
+        }
+
+        ntag = (lfs_frombe32(ntag) ^ tag) & 0x7fffffff;
+
+        if (lfs_tag_id(gmask) != 0 &&
+                lfs_tag_type1(tag) == LFS_TYPE_SPLICE &&
+                lfs_tag_id(tag) <= lfs_tag_id(gtag - gdiff)) {
+            if (tag == (LFS_MKTAG(LFS_TYPE_CREATE, 0, 0) |
+                    (LFS_MKTAG(0, 0x3ff, 0) & (gtag - gdiff)))) {
+                // found where we were created
+                return LFS_ERR_NOENT;
+            }
+
+            // move around splices
+            gdiff += LFS_MKTAG(0, lfs_tag_splice(tag), 0);
+        }
+
+        if ((gmask & tag) == (gmask & (gtag - gdiff))) {
+            if (lfs_tag_isdelete(tag)) {
+                return LFS_ERR_NOENT;
+            }
+
+            lfs_size_t diff = lfs_min(lfs_tag_size(tag), gsize);
+            err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, diff,
+                    dir->pair[0], off+sizeof(tag)+goff, gbuffer, diff);
+            if (err) {
+                return err;
+            }
+
+            memset((uint8_t*)gbuffer + diff, 0, gsize - diff);
+
+            return tag + gdiff;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+
+static lfs_stag_t lfs_dir_get(lfs_t *lfs, const lfs_mdir_t *dir,
+        lfs_tag_t gmask, lfs_tag_t gtag, void *buffer) {
+    return lfs_dir_getslice(lfs, dir,
+            gmask, gtag,
+            0, buffer, lfs_tag_size(gtag));
+}
+
+static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_tag_t gmask, lfs_tag_t gtag,
         lfs_off_t off, void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
@@ -835,6 +1486,73 @@ static int lfs_dir_traverse_filter(void *p,
 #endif
 
 #ifndef LFS_READONLY
+// the tag cache keeps the decoded tags of one metadata log, in order
+struct lfs_tcache_entry {
+    lfs_tag_t tag;
+    lfs_off_t off;
+};
+
+// read and decode the tag at off during a traversal, with a tag cache
+// any tags we decode from the start of the log are remembered
+static int lfs_dir_traversetag(lfs_t *lfs, lfs_block_t block, lfs_off_t off,
+        lfs_tag_t ptag, lfs_tag_t *tag) {
+    struct lfs_tcache_entry *entries
+            = (struct lfs_tcache_entry*)lfs->tcache.buffer;
+    lfs_size_t count = lfs->tcache.count;
+    if (lfs->tcache.block == block
+            && count > 0
+            && off <= entries[count-1].off) {
+        // tags are in order of their offset
+        lfs_size_t lo = 0;
+        lfs_size_t hi = count;
+        while (lo < hi) {
+            lfs_size_t mid = lo + (hi-lo)/2;
+            if (entries[mid].off < off) {
+                lo = mid+1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (entries[lo].off == off) {
+            *tag = entries[lo].tag;
+            return 0;
+        }
+    }
+
+    int err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, sizeof(*tag),
+            block, off, tag, sizeof(*tag));
+    if (err) {
+        return err;
+    }
+    *tag = (lfs_frombe32(*tag) ^ ptag) | 0x80000000;
+
+    if (lfs->cfg->tag_cache_size) {
+        // start over with a new log?
+        if (off == sizeof(uint32_t) && lfs->tcache.block != block) {
+            lfs->tcache.block = block;
+            lfs->tcache.count = 0;
+            count = 0;
+        }
+
+        // remember the tag if it continues the cached log
+        if (lfs->tcache.block == block
+                && count < lfs->cfg->tag_cache_size
+                    / sizeof(struct lfs_tcache_entry)
+                && off == ((count > 0)
+                    ? entries[count-1].off
+                        + lfs_tag_dsize(entries[count-1].tag)
+                    : sizeof(uint32_t))) {
+            entries[count].tag = *tag;
+            entries[count].off = off;
+            lfs->tcache.count += 1;
+        }
+    }
+
+    return 0;
+}
+
 // maximum recursive depth of lfs_dir_traverse, the deepest call:
 //
 // traverse with commit
@@ -884,14 +1602,12 @@ static int lfs_dir_traverse(lfs_t *lfs,
         {
             if (off+lfs_tag_dsize(ptag) < dir->off) {
                 off += lfs_tag_dsize(ptag);
-                int err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, sizeof(tag),
-                        dir->pair[0], off, &tag, sizeof(tag));
+                int err = lfs_dir_traversetag(lfs,
+                        dir->pair[0], off, ptag, &tag);
                 if (err) {
                     return err;
                 }
 
-                tag = (lfs_frombe32(tag) ^ ptag) | 0x80000000;
                 disk.block = dir->pair[0];
                 disk.off = off+sizeof(lfs_tag_t);
                 buffer = &disk;
@@ -1427,116 +2143,399 @@ static int lfs_dir_find_match(void *data,
     return LFS_CMP_EQ;
 }
 
-static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
-        const char **path, uint16_t *id) {
-    // we reduce path to a single name if we can find it
-    const char *name = *path;
-    if (id) {
-        *id = 0x3ff;
-    }
+/// Directory name index ///
 
-    // default to root dir
-    lfs_stag_t tag = LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
-    dir->tail[0] = lfs->root[0];
-    dir->tail[1] = lfs->root[1];
+// The name index is a hash of every name in one directory. Snapshots of the
+// directory's metadata pairs are packed from the start of the index buffer,
+// while the name hashes are packed backwards from the end of the buffer.
+struct lfs_nindex_entry {
+    uint32_t hash;
+    uint16_t m;
+    uint16_t id;
+};
 
-    while (true) {
-nextname:
-        // skip slashes
-        name += strspn(name, "/");
-        lfs_size_t namelen = strcspn(name, "/");
+static inline lfs_mdir_t *lfs_nindex_mdir(lfs_t *lfs, lfs_size_t m) {
+    return &((lfs_mdir_t*)lfs->nindex.buffer)[m];
+}
 
-        // skip '.' and root '..'
-        if ((namelen == 1 && memcmp(name, ".", 1) == 0) ||
-            (namelen == 2 && memcmp(name, "..", 2) == 0)) {
-            name += namelen;
-            goto nextname;
-        }
+static inline struct lfs_nindex_entry *lfs_nindex_entry(lfs_t *lfs,
+        lfs_size_t i) {
+    lfs_size_t size = lfs_aligndown(lfs->cfg->name_index_size, 4);
+    return (struct lfs_nindex_entry*)&lfs->nindex.buffer[size] - 1 - i;
+}
 
-        // skip if matched by '..' in name
-        const char *suffix = name + namelen;
-        lfs_size_t sufflen;
-        int depth = 1;
-        while (true) {
-            suffix += strspn(suffix, "/");
-            sufflen = strcspn(suffix, "/");
-            if (sufflen == 0) {
-                break;
-            }
+static inline bool lfs_nindex_fits(lfs_t *lfs,
+        lfs_size_t mcount, lfs_size_t count) {
+    return mcount <= 0xffff
+            && mcount*sizeof(lfs_mdir_t)
+                + count*sizeof(struct lfs_nindex_entry)
+            <= lfs_aligndown(lfs->cfg->name_index_size, 4);
+}
 
-            if (sufflen == 2 && memcmp(suffix, "..", 2) == 0) {
-                depth -= 1;
-                if (depth == 0) {
-                    name = suffix + sufflen;
-                    goto nextname;
-                }
-            } else {
-                depth += 1;
-            }
+static inline void lfs_nindex_remove(lfs_t *lfs, lfs_size_t i) {
+    *lfs_nindex_entry(lfs, i) = *lfs_nindex_entry(lfs, lfs->nindex.count-1);
+    lfs->nindex.count -= 1;
+}
 
-            suffix += sufflen;
+// Hash the name of an entry, or if name is provided compare against it,
+// returning 0 if the names differ
+static lfs_stag_t lfs_nindex_name(lfs_t *lfs, const lfs_mdir_t *dir,
+        uint16_t id, const char *name, lfs_size_t namelen, uint32_t *hash) {
+    uint8_t dat[16];
+    lfs_stag_t tag = lfs_dir_getslice(lfs, dir, LFS_MKTAG(0x780, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_NAME, id, 0), 0, dat, 0);
+    if (tag < 0) {
+        return tag;
+    }
+
+    if (name && lfs_tag_size(tag) != namelen) {
+        return 0;
+    }
+
+    *hash = 0xffffffff;
+    lfs_size_t diff = 0;
+    for (lfs_off_t i = 0; i < lfs_tag_size(tag); i += diff) {
+        diff = lfs_min(lfs_tag_size(tag)-i, sizeof(dat));
+        lfs_stag_t res = lfs_dir_getslice(lfs, dir,
+                LFS_MKTAG(0x780, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_NAME, id, 0), i, dat, diff);
+        if (res < 0) {
+            return res;
         }
 
-        // found path
-        if (name[0] == '\0') {
-            return tag;
+        if (name) {
+            if (memcmp(dat, &name[i], diff) != 0) {
+                return 0;
+            }
+        } else {
+            *hash = lfs_crc(*hash, dat, diff);
         }
+    }
 
-        // update what we've found so far
-        *path = name;
+    return tag;
+}
 
-        // only continue if we hit a directory
-        if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
-            return LFS_ERR_NOTDIR;
+static int lfs_nindex_build(lfs_t *lfs) {
+    // assume the directory doesn't fit until we've seen all of it
+    lfs->nindex.state = LFS_NINDEX_FULL;
+    lfs->nindex.mcount = 0;
+    lfs->nindex.count = 0;
+
+    lfs_block_t tail[2] = {lfs->nindex.head[0], lfs->nindex.head[1]};
+    while (true) {
+        if (!lfs_nindex_fits(lfs, lfs->nindex.mcount+1, lfs->nindex.count)) {
+            return 0;
         }
 
-        // grab the entry data
-        if (lfs_tag_id(tag) != 0x3ff) {
-            lfs_stag_t res = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), dir->tail);
-            if (res < 0) {
-                return res;
-            }
-            lfs_pair_fromle32(dir->tail);
+        lfs_mdir_t *m = lfs_nindex_mdir(lfs, lfs->nindex.mcount);
+        int err = lfs_dir_fetch(lfs, m, tail);
+        if (err) {
+            lfs->nindex.state = LFS_NINDEX_NONE;
+            return err;
         }
+        lfs->nindex.mcount += 1;
 
-        // find entry matching name
-        while (true) {
-            tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
-                    LFS_MKTAG(0x780, 0, 0),
-                    LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
-                     // are we last name?
-                    (strchr(name, '/') == NULL) ? id : NULL,
-                    lfs_dir_find_match, &(struct lfs_dir_find_match){
-                        lfs, name, namelen});
-            if (tag < 0) {
+        for (uint16_t id = 0; id < m->count; id++) {
+            uint32_t hash;
+            lfs_stag_t tag = lfs_nindex_name(lfs, m, id, NULL, 0, &hash);
+            if (tag < 0 && tag != LFS_ERR_NOENT) {
+                lfs->nindex.state = LFS_NINDEX_NONE;
                 return tag;
             }
 
-            if (tag) {
-                break;
+            if (tag == LFS_ERR_NOENT) {
+                continue;
             }
 
-            if (!dir->split) {
-                return LFS_ERR_NOENT;
+            if (!lfs_nindex_fits(lfs,
+                    lfs->nindex.mcount, lfs->nindex.count+1)) {
+                return 0;
             }
+
+            *lfs_nindex_entry(lfs, lfs->nindex.count) = (struct lfs_nindex_entry){
+                hash, lfs->nindex.mcount-1, id};
+            lfs->nindex.count += 1;
         }
 
-        // to next name
-        name += namelen;
+        if (!m->split) {
+            break;
+        }
+
+        tail[0] = m->tail[0];
+        tail[1] = m->tail[1];
     }
+
+    lfs->nindex.state = LFS_NINDEX_VALID;
+    return 0;
 }
 
-// commit logic
-struct lfs_commit {
-    lfs_block_t block;
-    lfs_off_t off;
-    lfs_tag_t ptag;
-    uint32_t crc;
+// Look up a name in the directory whose head is in dir->tail. Returns the
+// name's tag and updates dir and id if found, LFS_ERR_NOENT if the name is
+// not in the directory, or 0 if the index can't tell and we need to scan.
+static lfs_stag_t lfs_nindex_find(lfs_t *lfs, lfs_mdir_t *dir,
+        const char *name, lfs_size_t namelen, uint16_t *id) {
+    // pending moves shift ids around, but only last until the next commit
+    if (!lfs->cfg->name_index_size || lfs_gstate_hasmove(&lfs->gdisk)) {
+        return 0;
+    }
 
-    lfs_off_t begin;
-    lfs_off_t end;
-};
+    // only index a directory after it's been searched twice in a row, this
+    // avoids rebuilding the index when we're just passing through
+    if (!lfs_pair_issync(lfs->nindex.head, dir->tail)) {
+        lfs->nindex.head[0] = dir->tail[0];
+        lfs->nindex.head[1] = dir->tail[1];
+        lfs->nindex.state = LFS_NINDEX_NONE;
+        return 0;
+    }
+
+    if (lfs->nindex.state == LFS_NINDEX_NONE) {
+        int err = lfs_nindex_build(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (lfs->nindex.state != LFS_NINDEX_VALID) {
+        return 0;
+    }
+
+    uint32_t hash = lfs_crc(0xffffffff, name, namelen);
+    for (lfs_size_t i = 0; i < lfs->nindex.count; i++) {
+        const struct lfs_nindex_entry *e = lfs_nindex_entry(lfs, i);
+        if (e->hash != hash) {
+            continue;
+        }
+
+        const lfs_mdir_t *m = lfs_nindex_mdir(lfs, e->m);
+        lfs_stag_t tag = lfs_nindex_name(lfs, m, e->id, name, namelen, &hash);
+        if (tag < 0 && tag != LFS_ERR_NOENT) {
+            return tag;
+        }
+
+        if (tag == LFS_ERR_NOENT) {
+            // out of sync? this shouldn't happen, but scanning is always safe
+            lfs->nindex.state = LFS_NINDEX_NONE;
+            return 0;
+        }
+
+        if (tag) {
+            *dir = *m;
+            if (id) {
+                *id = e->id;
+            }
+            return tag;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+
+#ifndef LFS_READONLY
+// Apply a successful commit to the name index
+static void lfs_nindex_commit(lfs_t *lfs, const lfs_block_t pair[2],
+        const lfs_mdir_t *dir, const struct lfs_mattr *attrs, int attrcount,
+        int state) {
+    if (lfs->nindex.state != LFS_NINDEX_VALID) {
+        return;
+    }
+
+    lfs_size_t m = 0;
+    while (m < lfs->nindex.mcount
+            && lfs_pair_cmp(lfs_nindex_mdir(lfs, m)->pair, pair) != 0) {
+        m += 1;
+    }
+
+    if (m == lfs->nindex.mcount) {
+        return;
+    }
+
+    // relocations, drops, and splits change the shape of the directory,
+    // these are rare enough that it's easier to rebuild the index
+    const lfs_mdir_t *old = lfs_nindex_mdir(lfs, m);
+    if (state != 0 || lfs_gstate_hasmove(&lfs->gdisk) ||
+            ((old->split || dir->split) && (old->split != dir->split ||
+                !lfs_pair_issync(old->tail, dir->tail)))) {
+        lfs->nindex.state = LFS_NINDEX_NONE;
+        return;
+    }
+
+    for (int i = 0; i < attrcount; i++) {
+        lfs_tag_t tag = attrs[i].tag;
+        uint16_t id = lfs_tag_id(tag);
+        bool isname = (lfs_tag_type1(tag) == LFS_TYPE_NAME
+                && lfs_tag_type3(tag) != LFS_FROM_NOOP
+                && id != 0x3ff);
+        if (lfs_tag_type3(tag) != LFS_TYPE_DELETE
+                && lfs_tag_type3(tag) != LFS_TYPE_CREATE
+                && !isname) {
+            continue;
+        }
+
+        for (lfs_size_t j = 0; j < lfs->nindex.count;) {
+            struct lfs_nindex_entry *e = lfs_nindex_entry(lfs, j);
+            if (e->m == m && e->id == id
+                    && lfs_tag_type3(tag) != LFS_TYPE_CREATE) {
+                // deleted or renamed
+                lfs_nindex_remove(lfs, j);
+                continue;
+            } else if (e->m == m && e->id > id
+                    && lfs_tag_type3(tag) == LFS_TYPE_DELETE) {
+                e->id -= 1;
+            } else if (e->m == m && e->id >= id
+                    && lfs_tag_type3(tag) == LFS_TYPE_CREATE) {
+                e->id += 1;
+            }
+            j += 1;
+        }
+
+        // hidden names are never found by lfs_dir_find
+        if (isname && !(lfs_tag_type3(tag) & 0x080)) {
+            if (!lfs_nindex_fits(lfs,
+                    lfs->nindex.mcount, lfs->nindex.count+1)) {
+                lfs->nindex.state = LFS_NINDEX_NONE;
+                return;
+            }
+
+            *lfs_nindex_entry(lfs, lfs->nindex.count) = (struct lfs_nindex_entry){
+                lfs_crc(0xffffffff, attrs[i].buffer, lfs_tag_size(tag)),
+                m, id};
+            lfs->nindex.count += 1;
+        }
+    }
+
+    *lfs_nindex_mdir(lfs, m) = *dir;
+}
+#endif
+
+// find a name in the directory starting at dir->tail, if the name is not
+// found, id is set to where it would be created
+static lfs_stag_t lfs_dir_findname(lfs_t *lfs, lfs_mdir_t *dir,
+        const char *name, lfs_size_t namelen, uint16_t *id) {
+    // try the name index, note we still need to scan to find where
+    // a missing name would be created
+    lfs_stag_t tag = lfs_nindex_find(lfs, dir, name, namelen, id);
+    if (tag == LFS_ERR_NOENT && id) {
+        tag = 0;
+    } else if (tag < 0) {
+        return tag;
+    }
+
+    while (!tag) {
+        tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
+                LFS_MKTAG(0x780, 0, 0),
+                LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
+                id,
+                lfs_dir_find_match, &(struct lfs_dir_find_match){
+                    lfs, name, namelen});
+        if (tag < 0) {
+            return tag;
+        }
+
+        if (!tag && !dir->split) {
+            return LFS_ERR_NOENT;
+        }
+    }
+
+    return tag;
+}
+
+static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
+        const char **path, uint16_t *id) {
+    // we reduce path to a single name if we can find it
+    const char *name = *path;
+    if (id) {
+        *id = 0x3ff;
+    }
+
+    // default to root dir
+    lfs_stag_t tag = LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
+    dir->tail[0] = lfs->root[0];
+    dir->tail[1] = lfs->root[1];
+
+    while (true) {
+nextname:
+        // skip slashes
+        name += strspn(name, "/");
+        lfs_size_t namelen = strcspn(name, "/");
+
+        // skip '.' and root '..'
+        if ((namelen == 1 && memcmp(name, ".", 1) == 0) ||
+            (namelen == 2 && memcmp(name, "..", 2) == 0)) {
+            name += namelen;
+            goto nextname;
+        }
+
+        // skip if matched by '..' in name
+        const char *suffix = name + namelen;
+        lfs_size_t sufflen;
+        int depth = 1;
+        while (true) {
+            suffix += strspn(suffix, "/");
+            sufflen = strcspn(suffix, "/");
+            if (sufflen == 0) {
+                break;
+            }
+
+            if (sufflen == 2 && memcmp(suffix, "..", 2) == 0) {
+                depth -= 1;
+                if (depth == 0) {
+                    name = suffix + sufflen;
+                    goto nextname;
+                }
+            } else {
+                depth += 1;
+            }
+
+            suffix += sufflen;
+        }
+
+        // found path
+        if (name[0] == '\0') {
+            return tag;
+        }
+
+        // update what we've found so far
+        *path = name;
+
+        // only continue if we hit a directory
+        if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
+            return LFS_ERR_NOTDIR;
+        }
+
+        // grab the entry data
+        if (lfs_tag_id(tag) != 0x3ff) {
+            lfs_stag_t res = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), dir->tail);
+            if (res < 0) {
+                return res;
+            }
+            lfs_pair_fromle32(dir->tail);
+        }
+
+        // are we last name?
+        uint16_t *lid = (strchr(name, '/') == NULL) ? id : NULL;
+
+        // find entry matching name
+        tag = lfs_dir_findname(lfs, dir, name, namelen, lid);
+        if (tag < 0) {
+            return tag;
+        }
+
+        // to next name
+        name += namelen;
+    }
+}
+
+// commit logic
+struct lfs_commit {
+    lfs_block_t block;
+    lfs_off_t off;
+    lfs_tag_t ptag;
+    uint32_t crc;
+
+    lfs_off_t begin;
+    lfs_off_t end;
+};
 
 #ifndef LFS_READONLY
 static int lfs_dir_commitprog(lfs_t *lfs, struct lfs_commit *commit,
@@ -1758,6 +2757,7 @@ static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
     for (int i = 0; i < 2; i++) {
         err = lfs_alloc(lfs, &dir->pair[(i+1)%2]);
         if (err) {
+            lfs_alloc_used(lfs, -i);
             return err;
         }
     }
@@ -1813,6 +2813,7 @@ static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
         return err;
     }
 
+    lfs_alloc_used(lfs, -2);
     return 0;
 }
 #endif
@@ -1833,8 +2834,12 @@ static int lfs_dir_split(lfs_t *lfs,
     tail.tail[1] = dir->tail[1];
 
     // note we don't care about LFS_OK_RELOCATED
+    LFS_STAT(lfs, splits, 1);
+    LFS_EVENT(lfs, LFS_EVENT_COMPACT_BEGIN);
     int res = lfs_dir_compact(lfs, &tail, attrs, attrcount, source, split, end);
+    LFS_EVENT(lfs, LFS_EVENT_COMPACT_END);
     if (res < 0) {
+        lfs_alloc_used(lfs, -2);
         return res;
     }
 
@@ -1877,6 +2882,16 @@ static int lfs_dir_commit_commit(void *p, lfs_tag_t tag, const void *buffer) {
 #endif
 
 #ifndef LFS_READONLY
+// restart any incremental compaction pass, the metadata pair it stopped at
+// may be relocated or dropped from the tail list
+static void lfs_compact_restart(lfs_t *lfs) {
+    if (!lfs_pair_isnull(lfs->compact.tail)) {
+        lfs->compact.tail[0] = 0;
+        lfs->compact.tail[1] = 1;
+        lfs->compact.count = 0;
+    }
+}
+
 static bool lfs_dir_needsrelocation(lfs_t *lfs, lfs_mdir_t *dir) {
     // If our revision count == n * block_cycles, we should force a relocation,
     // this is how littlefs wear-levels at the metadata-pair level. Note that we
@@ -1896,6 +2911,7 @@ static int lfs_dir_compact(lfs_t *lfs,
     // save some state in case block is bad
     bool relocated = false;
     bool tired = lfs_dir_needsrelocation(lfs, dir);
+    LFS_STAT(lfs, compacts, 1);
 
     // increment revision count
     dir->rev += 1;
@@ -2001,7 +3017,7 @@ static int lfs_dir_compact(lfs_t *lfs,
                 lfs_gstate_tole32(&delta);
                 err = lfs_dir_commitattr(lfs, &commit,
                         LFS_MKTAG(LFS_TYPE_MOVESTATE, 0x3ff,
-                            sizeof(delta)), &delta);
+                            lfs_gstate_size(&delta)), &delta);
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
                         goto relocate;
@@ -2036,6 +3052,8 @@ static int lfs_dir_compact(lfs_t *lfs,
 relocate:
         // commit was corrupted, drop caches and prepare to relocate block
         relocated = true;
+        LFS_STAT(lfs, relocations, 1);
+        lfs_compact_restart(lfs);
         lfs_cache_drop(lfs, &lfs->pcache);
         if (!tired) {
             LFS_DEBUG("Bad block at 0x%"PRIx32, dir->pair[1]);
@@ -2054,6 +3072,11 @@ relocate:
             return err;
         }
 
+        // the block we relocated from is no longer in use
+        if (!err) {
+            lfs_alloc_used(lfs, -1);
+        }
+
         tired = false;
         continue;
     }
@@ -2066,6 +3089,7 @@ relocate:
 static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
         const struct lfs_mattr *attrs, int attrcount,
         lfs_mdir_t *source, uint16_t begin, uint16_t end) {
+    int splits = 0;
     while (true) {
         // find size of first split, we do this by halving the split until
         // the metadata is guaranteed to fit
@@ -2089,17 +3113,17 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
             // space is complicated, we need room for:
             //
             // - tail:         4+2*4 = 12 bytes
-            // - gstate:       4+3*4 = 16 bytes
+            // - gstate:       4+6*4 = 28 bytes
             // - move delete:  4     = 4 bytes
             // - crc:          4+4   = 8 bytes
-            //                 total = 40 bytes
+            //                 total = 52 bytes
             //
             // And we cap at half a block to avoid degenerate cases with
             // nearly-full metadata blocks.
             //
             if (end - split < 0xff
                     && size <= lfs_min(
-                        lfs->cfg->block_size - 40,
+                        lfs->cfg->block_size - 52,
                         lfs_alignup(
                             (lfs->cfg->metadata_max
                                 ? lfs->cfg->metadata_max
@@ -2131,14 +3155,18 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
             break;
         } else {
             end = split;
+            splits += 1;
         }
     }
 
     if (lfs_dir_needsrelocation(lfs, dir)
             && lfs_pair_cmp(dir->pair, (const lfs_block_t[2]){0, 1}) == 0) {
         // oh no! we're writing too much to the superblock,
-        // should we expand?
-        lfs_ssize_t size = lfs_fs_rawsize(lfs);
+        // should we expand? note we don't start counting blocks in the
+        // middle of a commit
+        lfs_ssize_t size = (lfs->used != LFS_BLOCK_NULL)
+                ? (lfs_ssize_t)lfs->used
+                : lfs_fs_rawsize_exact(lfs);
         if (size < 0) {
             return size;
         }
@@ -2159,11 +3187,20 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
                 LFS_WARN("Unable to expand superblock");
             } else {
                 end = begin;
+                splits += 1;
             }
         }
     }
 
-    return lfs_dir_compact(lfs, dir, attrs, attrcount, source, begin, end);
+    LFS_EVENT(lfs, LFS_EVENT_COMPACT_BEGIN);
+    int res = lfs_dir_compact(lfs, dir, attrs, attrcount, source, begin, end);
+    LFS_EVENT(lfs, LFS_EVENT_COMPACT_END);
+    if (res < 0) {
+        // any tails we split off are lost with our commit
+        lfs_alloc_used(lfs, -2*splits);
+    }
+
+    return res;
 }
 #endif
 
@@ -2188,6 +3225,7 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
             dir->tail[1] = ((lfs_block_t*)attrs[i].buffer)[1];
             dir->split = (lfs_tag_chunk(attrs[i].tag) & 1);
             lfs_pair_fromle32(dir->tail);
+            lfs_compact_restart(lfs);
         }
     }
 
@@ -2248,7 +3286,7 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
             lfs_gstate_tole32(&delta);
             err = lfs_dir_commitattr(lfs, &commit,
                     LFS_MKTAG(LFS_TYPE_MOVESTATE, 0x3ff,
-                        sizeof(delta)), &delta);
+                        lfs_gstate_size(&delta)), &delta);
             if (err) {
                 if (err == LFS_ERR_NOSPC || err == LFS_ERR_CORRUPT) {
                     goto compact;
@@ -2298,11 +3336,19 @@ fixmlist:;
     // we need to copy the pair so they don't get clobbered if we refetch
     // our mdir.
     lfs_block_t oldpair[2] = {pair[0], pair[1]};
+    lfs_nindex_commit(lfs, oldpair, dir, attrs, attrcount, state);
     for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
         if (lfs_pair_cmp(d->m.pair, oldpair) == 0) {
             d->m = *dir;
             if (d->m.pair != pair) {
                 for (int i = 0; i < attrcount; i++) {
+                    if (d->type == LFS_TYPE_REG &&
+                            d->id == lfs_tag_id(attrs[i].tag)) {
+                        // someone else changed this file, its blocks may
+                        // have been freed, so we can't append in place
+                        ((lfs_file_t*)d)->flags &= ~LFS_F_ERASED;
+                    }
+
                     if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE &&
                             d->id == lfs_tag_id(attrs[i].tag)) {
                         d->m.pair[0] = LFS_BLOCK_NULL;
@@ -2399,6 +3445,8 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             return state;
         }
 
+        lfs_alloc_used(lfs, -2);
+
         ldir = pdir;
     }
 
@@ -2817,7 +3865,39 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
-static int lfs_ctz_find(lfs_t *lfs,
+#ifndef LFS_READONLY
+// number of blocks in a skip-list of size bytes
+static lfs_size_t lfs_ctz_count(lfs_t *lfs, lfs_size_t size) {
+    return (size > 0) ? lfs_ctz_index(lfs, &(lfs_off_t){size-1}) + 1 : 0;
+}
+#endif
+
+// files may remember the blocks in their skip-list at every 2^ishift
+// block index, this is only valid as long as those blocks aren't rewritten
+static lfs_size_t lfs_ctz_memocount(const lfs_file_t *file) {
+    // note temporary file structs may not have a config
+    return (file && file->cfg)
+            ? file->cfg->index_size / sizeof(lfs_block_t)
+            : 0;
+}
+
+static void lfs_ctz_memo(lfs_file_t *file,
+        lfs_off_t index, lfs_block_t block) {
+    lfs_size_t count = lfs_ctz_memocount(file);
+    if (index % (1U << file->ishift) == 0 && (index >> file->ishift) < count) {
+        ((lfs_block_t*)file->cfg->index_buffer)[index >> file->ishift] = block;
+    }
+}
+
+static void lfs_ctz_forget(lfs_file_t *file, lfs_off_t index) {
+    lfs_block_t *memo = (lfs_block_t*)file->cfg->index_buffer;
+    for (lfs_size_t i = (index + (1U << file->ishift)-1) >> file->ishift;
+            i < lfs_ctz_memocount(file); i++) {
+        memo[i] = LFS_BLOCK_NULL;
+    }
+}
+
+static int lfs_ctz_find(lfs_t *lfs, lfs_file_t *file,
         const lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
         lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
@@ -2830,6 +3910,27 @@ static int lfs_ctz_find(lfs_t *lfs,
     lfs_off_t current = lfs_ctz_index(lfs, &(lfs_off_t){size-1});
     lfs_off_t target = lfs_ctz_index(lfs, &pos);
 
+    lfs_size_t count = lfs_ctz_memocount(file);
+    if (count > 0) {
+        lfs_block_t *memo = (lfs_block_t*)file->cfg->index_buffer;
+        // spread out our entries if the file has outgrown them
+        while ((current >> file->ishift) >= count) {
+            for (lfs_size_t i = 0; i < count; i++) {
+                memo[i] = (2*i < count) ? memo[2*i] : LFS_BLOCK_NULL;
+            }
+            file->ishift += 1;
+        }
+
+        // start from the nearest remembered block after our target
+        lfs_size_t i = (target + (1U << file->ishift)-1) >> file->ishift;
+        if ((i << file->ishift) < current && memo[i] != LFS_BLOCK_NULL) {
+            current = i << file->ishift;
+            head = memo[i];
+        } else {
+            lfs_ctz_memo(file, current, head);
+        }
+    }
+
     while (current > target) {
         lfs_size_t skip = lfs_min(
                 lfs_npw2(current-target+1) - 1,
@@ -2844,6 +3945,9 @@ static int lfs_ctz_find(lfs_t *lfs,
         }
 
         current -= 1 << skip;
+        if (count > 0) {
+            lfs_ctz_memo(file, current, head);
+        }
     }
 
     *block = head;
@@ -2854,18 +3958,20 @@ static int lfs_ctz_find(lfs_t *lfs,
 #ifndef LFS_READONLY
 static int lfs_ctz_extend(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
+        struct lfs_extent *extent,
         lfs_block_t head, lfs_size_t size,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        bool erased;
+        int err = lfs_alloc_extending(lfs, extent, &nblock, &erased);
         if (err) {
             return err;
         }
 
         {
-            err = lfs_bd_erase(lfs, nblock);
+            err = (erased) ? 0 : lfs_bd_erasewait(lfs, nblock);
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -2944,6 +4050,7 @@ static int lfs_ctz_extend(lfs_t *lfs,
 
 relocate:
         LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
+        LFS_STAT(lfs, relocations, 1);
 
         // just clear cache and try a new block
         lfs_cache_drop(lfs, pcache);
@@ -2996,6 +4103,29 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 
 
 /// Top level file operations ///
+static int lfs_file_loadinline(lfs_t *lfs, lfs_file_t *file) {
+    // inline files live entirely in their cache
+    file->cache.block = file->ctz.head;
+    file->cache.off = 0;
+    file->cache.size = lfs->cfg->cache_size;
+
+    // don't always read (may be new/trunc file), removed files that never
+    // took a cache have nothing to read, like the blocks of removed
+    // outlined files their data is lost
+    if (file->ctz.size > 0 && !lfs_pair_isnull(file->m.pair)) {
+        lfs_stag_t res = lfs_dir_get(lfs, &file->m,
+                LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
+                    lfs_min(file->cache.size, 0x3fe)),
+                file->cache.buffer);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
 static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags,
         const struct lfs_file_config *cfg) {
@@ -3018,6 +4148,14 @@ static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
     file->pos = 0;
     file->off = 0;
     file->cache.buffer = NULL;
+    file->ishift = 0;
+    file->extent.block = LFS_BLOCK_NULL;
+    file->extent.count = 0;
+    file->extent.taken = 0;
+    if (lfs_ctz_memocount(file) > 0) {
+        LFS_ASSERT((uintptr_t)cfg->index_buffer % 4 == 0);
+        lfs_ctz_forget(file, 0);
+    }
 
     // allocate entry for file if it doesn't exist
     lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
@@ -3114,10 +4252,17 @@ static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
 #endif
     }
 
-    // allocate buffer if needed
+    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
+        file->ctz.head = LFS_BLOCK_INLINE;
+        file->ctz.size = lfs_tag_size(tag);
+        file->flags |= LFS_F_INLINE;
+    }
+
+    // allocate buffer if needed, files sharing the file cache pool borrow
+    // one when they are first read or written
     if (file->cfg->buffer) {
         file->cache.buffer = file->cfg->buffer;
-    } else {
+    } else if (!lfs->cfg->file_cache_count) {
         file->cache.buffer = lfs_malloc(lfs->cfg->cache_size);
         if (!file->cache.buffer) {
             err = LFS_ERR_NOMEM;
@@ -3125,30 +4270,24 @@ static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
         }
     }
 
-    // zero to avoid information leak
-    lfs_cache_zero(lfs, &file->cache);
-
-    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
-        // load inline files
-        file->ctz.head = LFS_BLOCK_INLINE;
-        file->ctz.size = lfs_tag_size(tag);
-        file->flags |= LFS_F_INLINE;
-        file->cache.block = file->ctz.head;
-        file->cache.off = 0;
-        file->cache.size = lfs->cfg->cache_size;
+    if (file->cache.buffer) {
+        // zero to avoid information leak
+        lfs_cache_zero(lfs, &file->cache);
 
-        // don't always read (may be new/trunc file)
-        if (file->ctz.size > 0) {
-            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
-                    LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
-                        lfs_min(file->cache.size, 0x3fe)),
-                    file->cache.buffer);
-            if (res < 0) {
-                err = res;
+        if (file->flags & LFS_F_INLINE) {
+            err = lfs_file_loadinline(lfs, file);
+            if (err) {
                 goto cleanup;
             }
         }
+    } else if ((file->flags & LFS_F_INLINE)
+            && file->ctz.size > lfs->cfg->cache_size) {
+        // inline files larger than our cache need a cache to be evicted,
+        // see lfs_dir_orphaningcommit, so they hold onto one
+        err = lfs_file_getcache(lfs, file);
+        if (err) {
+            goto cleanup;
+        }
     }
 
     return 0;
@@ -3171,6 +4310,32 @@ static int lfs_file_rawopen(lfs_t *lfs, lfs_file_t *file,
 }
 #endif
 
+// Reads that carry on from the last read, without a seek or write in
+// between, go through the shared readahead buffer. The buffer stays with the
+// first sequential reader until that file stops reading sequentially.
+static lfs_cache_t *lfs_file_readahead(lfs_t *lfs, const lfs_file_t *file) {
+    if (!lfs->cfg->readahead_size
+            || !(file->flags & LFS_F_READING)
+            || (file->flags & LFS_F_INLINE)) {
+        return NULL;
+    }
+
+    const lfs_file_t *owner = lfs->readahead.file;
+    if (owner && owner != file && (owner->flags & LFS_F_READING)) {
+        return NULL;
+    }
+
+    lfs->readahead.file = file;
+    return &lfs->readahead.cache;
+}
+
+// Give up the readahead buffer, if we have it
+static void lfs_file_dropahead(lfs_t *lfs, const lfs_file_t *file) {
+    if (lfs->readahead.file == file) {
+        lfs->readahead.file = NULL;
+    }
+}
+
 static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
 #ifndef LFS_READONLY
     int err = lfs_file_rawsync(lfs, file);
@@ -3178,11 +4343,21 @@ static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
     int err = 0;
 #endif
 
-    // remove from list of mdirs
+    // remove from list of mdirs, this also releases any reserved blocks
     lfs_mlist_remove(lfs, (struct lfs_mlist*)file);
+#ifndef LFS_READONLY
+    // and any blocks we took but never synced
+    lfs_alloc_used(lfs,
+            -(lfs_ssize_t)(file->extent.count + file->extent.taken));
+#endif
+    file->extent.count = 0;
+    file->extent.taken = 0;
 
-    // clean up memory
-    if (!file->cfg->buffer) {
+    lfs_file_dropahead(lfs, file);
+
+    // clean up memory, borrowed caches return to the pool once we are no
+    // longer in the mlist
+    if (!file->cfg->buffer && !lfs->cfg->file_cache_count) {
         lfs_free(file->cache.buffer);
     }
 
@@ -3191,25 +4366,83 @@ static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
 
 
 #ifndef LFS_READONLY
-static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
-    while (true) {
-        // just relocate what exists into new block
-        lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
-        if (err) {
-            return err;
-        }
+// largest size we keep a file inline, files we expect to grow larger are
+// moved out of the metadata as soon as they are written
+static lfs_size_t lfs_file_inlinemax(lfs_t *lfs, const lfs_file_t *file) {
+    if (file->cfg->size_hint > lfs->inline_max) {
+        return 0;
+    }
 
-        err = lfs_bd_erase(lfs, nblock);
-        if (err) {
-            if (err == LFS_ERR_CORRUPT) {
-                goto relocate;
-            }
-            return err;
-        }
+    return lfs->inline_max;
+}
+
+// reserve contiguous blocks for a file we expect to keep growing, index is
+// the index of the next block we allocate in the file's skip-list
+static int lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t index) {
+    if (file->extent.count > 0 || !file->cfg->size_hint) {
+        return 0;
+    }
+
+    lfs_off_t count = lfs_ctz_count(lfs, file->cfg->size_hint);
+    if (count <= index) {
+        return 0;
+    }
+
+    // ignore LFS_ERR_NOSPC, we'll find out when we actually need a block
+    int err = lfs_alloc_extent(lfs, count - index, &file->extent);
+    if (err && err != LFS_ERR_NOSPC) {
+        return err;
+    }
+
+    return 0;
+}
+
+static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
+    int err = lfs_file_reserve(lfs, file, (file->pos > 0)
+            ? lfs_ctz_index(lfs, &(lfs_off_t){file->pos-1})
+            : 0);
+    if (err) {
+        return err;
+    }
+
+    while (true) {
+        // just relocate what exists into new block
+        lfs_block_t nblock;
+        bool erased;
+        err = lfs_alloc_extending(lfs, &file->extent, &nblock, &erased);
+        if (err) {
+            return err;
+        }
+
+        err = (erased) ? 0 : lfs_bd_erasewait(lfs, nblock);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
+
+        // inline files are usually entirely in our cache, so we can
+        // program them in one go
+        lfs_off_t i = 0;
+        if ((file->flags & LFS_F_INLINE)
+                && file->cache.block == LFS_BLOCK_INLINE
+                && file->cache.off == 0
+                && file->cache.size >= file->off) {
+            err = lfs_bd_prog(lfs,
+                    &lfs->pcache, &lfs->rcache, true,
+                    nblock, 0, file->cache.buffer, file->off);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+            i = file->off;
+        }
 
-        // either read from dirty cache or disk
-        for (lfs_off_t i = 0; i < file->off; i++) {
+        // otherwise either read from dirty cache or disk
+        for (; i < file->off; i++) {
             uint8_t data;
             if (file->flags & LFS_F_INLINE) {
                 err = lfs_dir_getread(lfs, &file->m,
@@ -3254,6 +4487,7 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
 
 relocate:
         LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
+        LFS_STAT(lfs, relocations, 1);
 
         // just clear cache and try a new block
         lfs_cache_drop(lfs, &lfs->pcache);
@@ -3270,11 +4504,31 @@ static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
 
+    if (lfs_ctz_memocount(file) > 0) {
+        lfs_ctz_forget(file, 0);
+    }
+
     file->flags &= ~LFS_F_INLINE;
     return 0;
 }
 #endif
 
+#ifndef LFS_READONLY
+static bool lfs_file_iserased(lfs_t *lfs, lfs_file_t *file) {
+    if (!(file->flags & LFS_F_ERASED) || file->pos == 0
+            || file->pos != file->ctz.size
+            || file->block != file->ctz.head) {
+        return false;
+    }
+
+    // reads may have moved our block/off, make sure they still point to
+    // the end of the file
+    lfs_off_t off = file->pos - 1;
+    lfs_ctz_index(lfs, &off);
+    return file->off == off+1;
+}
+#endif
+
 static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
     if (file->flags & LFS_F_READING) {
         if (!(file->flags & LFS_F_INLINE)) {
@@ -3299,16 +4553,21 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
             lfs_cache_drop(lfs, &lfs->rcache);
 
             while (file->pos < file->ctz.size) {
-                // copy over a byte at a time, leave it up to caching
+                // copy over a few bytes at a time, leave it up to caching
                 // to make this efficient
-                uint8_t data;
-                lfs_ssize_t res = lfs_file_flushedread(lfs, &orig, &data, 1);
+                uint8_t data[8];
+                lfs_size_t diff = lfs_min(file->ctz.size - file->pos,
+                        sizeof(data));
+                lfs_ssize_t res = lfs_file_flushedread(lfs, &orig,
+                        data, diff);
                 if (res < 0) {
+                    lfs_file_dropahead(lfs, &orig);
                     return res;
                 }
 
-                res = lfs_file_flushedwrite(lfs, file, &data, 1);
+                res = lfs_file_flushedwrite(lfs, file, data, diff);
                 if (res < 0) {
+                    lfs_file_dropahead(lfs, &orig);
                     return res;
                 }
 
@@ -3319,6 +4578,9 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
                 }
             }
 
+            // orig only lives on our stack
+            lfs_file_dropahead(lfs, &orig);
+
             // write out what we have
             while (true) {
                 int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
@@ -3333,6 +4595,7 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
 
 relocate:
                 LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
+                LFS_STAT(lfs, relocations, 1);
                 err = lfs_file_relocate(lfs, file);
                 if (err) {
                     return err;
@@ -3348,6 +4611,15 @@ relocate:
         file->flags &= ~LFS_F_WRITING;
         file->flags |= LFS_F_DIRTY;
 
+        // we only programmed up to the next prog boundary, so if we ended
+        // on one, the rest of our last block is still erased
+        if ((file->flags & LFS_O_LOG)
+                && !(file->flags & LFS_F_INLINE)
+                && file->off % lfs->cfg->prog_size == 0
+                && file->off < lfs->cfg->block_size) {
+            file->flags |= LFS_F_ERASED;
+        }
+
         file->pos = pos;
     }
 #endif
@@ -3356,7 +4628,76 @@ relocate:
 }
 
 #ifndef LFS_READONLY
+static void lfs_file_syncattrs(lfs_t *lfs, lfs_file_t *file,
+        struct lfs_ctz *ctz, struct lfs_mattr attrs[2]) {
+    (void)lfs;
+    uint16_t type;
+    const void *buffer;
+    lfs_size_t size;
+    if (file->flags & LFS_F_INLINE) {
+        // inline the whole file
+        type = LFS_TYPE_INLINESTRUCT;
+        buffer = file->cache.buffer;
+        size = file->ctz.size;
+    } else {
+        // update the ctz reference
+        type = LFS_TYPE_CTZSTRUCT;
+        // copy ctz so alloc will work during a relocate
+        *ctz = file->ctz;
+        lfs_ctz_tole32(ctz);
+        buffer = ctz;
+        size = sizeof(*ctz);
+    }
+
+    // file data and attributes, inline files only give up a borrowed cache
+    // once synced, so without one only our attributes can be out of date
+    attrs[0] = (struct lfs_mattr){
+            LFS_MKTAG_IF(!(file->flags & LFS_F_INLINE)
+                    || file->cache.buffer
+                    || file->ctz.size == 0,
+                type, file->id, size),
+            buffer};
+    attrs[1] = (struct lfs_mattr){
+            LFS_MKTAG(LFS_FROM_USERATTRS, file->id, file->cfg->attr_count),
+            file->cfg->attrs};
+}
+
+// find how many blocks an entry's data uses on disk, so we know what is
+// freed when it's replaced, there's no need if we aren't counting blocks
+static lfs_ssize_t lfs_dir_getused(lfs_t *lfs, lfs_mdir_t *dir,
+        uint16_t id) {
+    if (lfs->used == LFS_BLOCK_NULL) {
+        return 0;
+    }
+
+    struct lfs_ctz ctz;
+    lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
+    if (tag < 0) {
+        return (tag == LFS_ERR_NOENT) ? 0 : tag;
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_CTZSTRUCT) {
+        return 0;
+    }
+
+    lfs_ctz_fromle32(&ctz);
+    return lfs_ctz_count(lfs, ctz.size);
+}
+
+// after a sync the file uses exactly the blocks in its skip-list, any
+// other blocks it took since the last sync are free again
+static void lfs_file_synced(lfs_t *lfs, lfs_file_t *file, lfs_size_t used) {
+    lfs_size_t count = (file->flags & LFS_F_INLINE)
+            ? 0
+            : lfs_ctz_count(lfs, file->ctz.size);
+    lfs_alloc_used(lfs, (lfs_ssize_t)(count - used - file->extent.taken));
+    file->extent.taken = 0;
+}
+
 static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
     if (file->flags & LFS_F_ERRED) {
         // it's not safe to do anything if our file errored
         return 0;
@@ -3371,43 +4712,166 @@ static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
 
     if ((file->flags & LFS_F_DIRTY) &&
             !lfs_pair_isnull(file->m.pair)) {
+        lfs_ssize_t used = lfs_dir_getused(lfs, &file->m, file->id);
+        if (used < 0) {
+            return used;
+        }
+
         // update dir entry
-        uint16_t type;
-        const void *buffer;
-        lfs_size_t size;
         struct lfs_ctz ctz;
-        if (file->flags & LFS_F_INLINE) {
-            // inline the whole file
-            type = LFS_TYPE_INLINESTRUCT;
-            buffer = file->cache.buffer;
-            size = file->ctz.size;
-        } else {
-            // update the ctz reference
-            type = LFS_TYPE_CTZSTRUCT;
-            // copy ctz so alloc will work during a relocate
-            ctz = file->ctz;
-            lfs_ctz_tole32(&ctz);
-            buffer = &ctz;
-            size = sizeof(ctz);
-        }
+        struct lfs_mattr attrs[2];
+        lfs_file_syncattrs(lfs, file, &ctz, attrs);
 
         // commit file data and attributes
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(type, file->id, size), buffer},
-                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
-                    file->cfg->attr_count), file->cfg->attrs}));
+        err = lfs_dir_commit(lfs, &file->m, attrs, 2);
         if (err) {
             file->flags |= LFS_F_ERRED;
             return err;
         }
 
         file->flags &= ~LFS_F_DIRTY;
+        lfs_file_synced(lfs, file, used);
     }
 
     return 0;
 }
 #endif
 
+static int lfs_file_putcache(lfs_t *lfs, lfs_file_t *file) {
+#ifndef LFS_READONLY
+    if ((file->flags & LFS_F_INLINE)
+            && (file->flags & (LFS_F_WRITING | LFS_F_DIRTY))) {
+        // inline files only live in their cache, so they need to be synced
+        int err = lfs_file_rawsync(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    // write out any pending data
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    file->cache.buffer = NULL;
+    file->cache.block = LFS_BLOCK_NULL;
+    file->cache.off = 0;
+    file->cache.size = 0;
+    return 0;
+}
+
+static int lfs_file_getcache(lfs_t *lfs, lfs_file_t *file) {
+    if (file->cache.buffer) {
+        return 0;
+    }
+    LFS_ASSERT(lfs->cfg->file_cache_count && !file->cfg->buffer);
+
+    // look for an unused cache, otherwise take the cache of another file,
+    // preferring files we don't need to write out, and starting after the
+    // last cache we handed out so caches are taken round-robin
+    lfs_size_t count = lfs->cfg->file_cache_count;
+    uint8_t *buffer = NULL;
+    lfs_file_t *victim = NULL;
+    bool victimdirty = false;
+    for (lfs_size_t j = 0; j < count && !buffer; j++) {
+        uint8_t *b = &lfs->fcache.buffer[
+                ((lfs->fcache.next + j) % count) * lfs->cfg->cache_size];
+
+        lfs_file_t *owner = NULL;
+        for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+            if (f->type == LFS_TYPE_REG && f->cache.buffer == b) {
+                owner = f;
+                break;
+            }
+        }
+
+        if (!owner) {
+            buffer = b;
+            break;
+        }
+
+        // lent out caches are off limits, as are inline files larger than
+        // our cache, see lfs_dir_orphaningcommit, and removed inline files,
+        // which have nowhere to reload their data from
+        if ((owner->flags & LFS_F_LENT)
+                || ((owner->flags & LFS_F_INLINE)
+                    && (owner->ctz.size > lfs->cfg->cache_size
+                        || lfs_pair_isnull(owner->m.pair)))) {
+            continue;
+        }
+
+        bool dirty = false;
+#ifndef LFS_READONLY
+        dirty = (owner->flags & LFS_F_WRITING)
+                || ((owner->flags & LFS_F_INLINE)
+                    && (owner->flags & LFS_F_DIRTY));
+        if (dirty && (owner->flags & LFS_F_ERRED)) {
+            // can't write this out
+            continue;
+        }
+#endif
+
+        if (!victim || (victimdirty && !dirty)) {
+            victim = owner;
+            victimdirty = dirty;
+        }
+    }
+
+    if (!buffer) {
+        if (!victim) {
+            return LFS_ERR_NOMEM;
+        }
+
+        buffer = victim->cache.buffer;
+        int err = lfs_file_putcache(lfs, victim);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs->fcache.next = ((buffer - lfs->fcache.buffer) / lfs->cfg->cache_size
+            + 1) % count;
+    file->cache.buffer = buffer;
+
+    // zero to avoid information leak
+    lfs_cache_zero(lfs, &file->cache);
+
+    if (file->flags & LFS_F_INLINE) {
+        int err = lfs_file_loadinline(lfs, file);
+        if (err) {
+            file->cache.buffer = NULL;
+            file->cache.block = LFS_BLOCK_NULL;
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int lfs_file_readblock(lfs_t *lfs, lfs_file_t *file) {
+    // check if we need a new block
+    if (!(file->flags & LFS_F_READING) ||
+            file->off == lfs->cfg->block_size) {
+        if (!(file->flags & LFS_F_INLINE)) {
+            int err = lfs_ctz_find(lfs, file, NULL, &file->cache,
+                    file->ctz.head, file->ctz.size,
+                    file->pos, &file->block, &file->off);
+            if (err) {
+                return err;
+            }
+        } else {
+            file->block = LFS_BLOCK_INLINE;
+            file->off = file->pos;
+        }
+
+        file->flags |= LFS_F_READING;
+    }
+
+    return 0;
+}
+
 static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
@@ -3421,23 +4885,13 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
     size = lfs_min(size, file->ctz.size - file->pos);
     nsize = size;
 
-    while (nsize > 0) {
-        // check if we need a new block
-        if (!(file->flags & LFS_F_READING) ||
-                file->off == lfs->cfg->block_size) {
-            if (!(file->flags & LFS_F_INLINE)) {
-                int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                        file->ctz.head, file->ctz.size,
-                        file->pos, &file->block, &file->off);
-                if (err) {
-                    return err;
-                }
-            } else {
-                file->block = LFS_BLOCK_INLINE;
-                file->off = file->pos;
-            }
+    // sequential? check before we start reading
+    lfs_cache_t *ahead = lfs_file_readahead(lfs, file);
 
-            file->flags |= LFS_F_READING;
+    while (nsize > 0) {
+        int err = lfs_file_readblock(lfs, file);
+        if (err) {
+            return err;
         }
 
         // read as much as we can in current block
@@ -3451,6 +4905,15 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
             if (err) {
                 return err;
             }
+        } else if (ahead) {
+            // read ahead to the end of the file, anything still in the
+            // file's cache is used first
+            int err = lfs_bd_read(lfs,
+                    &file->cache, ahead, file->ctz.size - file->pos,
+                    file->block, file->off, data, diff);
+            if (err) {
+                return err;
+            }
         } else {
             int err = lfs_bd_read(lfs,
                     NULL, &file->cache, lfs->cfg->block_size,
@@ -3472,11 +4935,17 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
 static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
 
 #ifndef LFS_READONLY
     if (file->flags & LFS_F_WRITING) {
         // flush out any writes
-        int err = lfs_file_flush(lfs, file);
+        err = lfs_file_flush(lfs, file);
         if (err) {
             return err;
         }
@@ -3486,19 +4955,215 @@ static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
     return lfs_file_flushedread(lfs, file, buffer, size);
 }
 
+static lfs_ssize_t lfs_file_rawreadv(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count) {
+    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        // flush out any writes
+        err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    lfs_size_t size = 0;
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_ssize_t nsize = lfs_file_flushedread(lfs, file,
+                iov[i].buffer, iov[i].size);
+        if (nsize < 0) {
+            return nsize;
+        }
+
+        size += nsize;
+        if ((lfs_size_t)nsize < iov[i].size) {
+            // reached eof
+            break;
+        }
+    }
+
+    return size;
+}
+
+static lfs_ssize_t lfs_file_rawreadzc(lfs_t *lfs, lfs_file_t *file,
+        const void **buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        // flush out any writes
+        err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    if (file->pos >= file->ctz.size || size == 0) {
+        // eof if past end
+        return 0;
+    }
+
+    size = lfs_min(size, file->ctz.size - file->pos);
+
+    err = lfs_file_readblock(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    if (lfs->cfg->mmap_base && !(file->flags & LFS_F_INLINE)) {
+        // memory-mapped device, lend out the rest of the block in place
+        size = lfs_min(size, lfs->cfg->block_size - file->off);
+        *buffer = lfs_bd_mmap(lfs, file->block, file->off);
+
+        file->pos += size;
+        file->off += size;
+        file->flags |= LFS_F_LENT;
+        return size;
+    }
+
+    // read one byte through the file cache, this loads as much of the block
+    // as fits if it isn't already cached
+    uint8_t dat;
+    if (file->flags & LFS_F_INLINE) {
+        err = lfs_dir_getread(lfs, &file->m,
+                NULL, &file->cache, lfs->cfg->block_size,
+                LFS_MKTAG(0xfff, 0x1ff, 0),
+                LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
+                file->off, &dat, 1);
+    } else {
+        err = lfs_bd_read(lfs,
+                NULL, &file->cache, lfs->cfg->block_size,
+                file->block, file->off, &dat, 1);
+    }
+    if (err) {
+        return err;
+    }
+
+    // lend out whatever is contiguous in the cache
+    LFS_ASSERT(file->off >= file->cache.off
+            && file->off < file->cache.off + file->cache.size);
+    size = lfs_min(size, lfs_min(
+            file->cache.off + file->cache.size - file->off,
+            lfs->cfg->block_size - file->off));
+    *buffer = &file->cache.buffer[file->off - file->cache.off];
+
+    file->pos += size;
+    file->off += size;
+    file->flags |= LFS_F_LENT;
+    return size;
+}
+
+static int lfs_file_rawreadzc_release(lfs_t *lfs, lfs_file_t *file) {
+    (void)lfs;
+    LFS_ASSERT(file->flags & LFS_F_LENT);
+    file->flags &= ~LFS_F_LENT;
+    return 0;
+}
+
+static lfs_ssize_t lfs_file_rawextents(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t off, struct lfs_file_extent *extents, lfs_size_t count) {
+    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        // flush out any writes
+        err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    if (off >= file->ctz.size || count == 0) {
+        // nothing past end
+        return 0;
+    }
+
+    if (file->flags & LFS_F_INLINE) {
+        // inline files live in their metadata pair, not in blocks
+        return LFS_ERR_INVAL;
+    }
+
+    // each extent runs to the end of its block or the file, the first
+    // one starts at off
+    lfs_off_t pos = off;
+    lfs_off_t last = off;
+    lfs_size_t n = 0;
+    while (n < count && pos < file->ctz.size) {
+        lfs_off_t boff = pos;
+        lfs_ctz_index(lfs, &boff);
+        extents[n].off = boff;
+        extents[n].size = lfs_min(
+                lfs->cfg->block_size - boff,
+                file->ctz.size - pos);
+        last = pos;
+        pos += extents[n].size;
+        n += 1;
+    }
+
+    // the skip-list only points backwards, so find the last block and
+    // follow the first pointer of each block back to the first
+    lfs_block_t block;
+    lfs_off_t boff;
+    err = lfs_ctz_find(lfs, file, NULL, &lfs->rcache,
+            file->ctz.head, file->ctz.size,
+            last, &block, &boff);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = n; i > 0; i--) {
+        extents[i-1].block = block;
+        extents[i-1].buffer = (lfs->cfg->mmap_base)
+                ? lfs_bd_mmap(lfs, block, extents[i-1].off)
+                : NULL;
+
+        if (i > 1) {
+            err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, sizeof(block),
+                    block, 0, &block, sizeof(block));
+            block = lfs_fromle32(block);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return n;
+}
+
 
 #ifndef LFS_READONLY
+// A NULL buffer writes zeros, used to fill holes without a zero buffer
 static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
     lfs_size_t nsize = size;
 
     if ((file->flags & LFS_F_INLINE) &&
-            lfs_max(file->pos+nsize, file->ctz.size) >
-            lfs_min(0x3fe, lfs_min(
-                lfs->cfg->cache_size,
-                (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) / 8))) {
+            lfs_max(file->pos+nsize, file->ctz.size)
+                > lfs_file_inlinemax(lfs, file)) {
         // inline file doesn't fit anymore
         int err = lfs_file_outline(lfs, file);
         if (err) {
@@ -3512,9 +5177,20 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         if (!(file->flags & LFS_F_WRITING) ||
                 file->off == lfs->cfg->block_size) {
             if (!(file->flags & LFS_F_INLINE)) {
+                if (!(file->flags & LFS_F_WRITING)
+                        && lfs_file_iserased(lfs, file)) {
+                    // the rest of our last block is still erased, keep
+                    // appending to it in place
+                    lfs_cache_zero(lfs, &file->cache);
+                    file->flags &= ~LFS_F_ERASED;
+                    file->flags |= LFS_F_WRITING;
+                    continue;
+                }
+                file->flags &= ~LFS_F_ERASED;
+
                 if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
-                    int err = lfs_ctz_find(lfs, NULL, &file->cache,
+                    int err = lfs_ctz_find(lfs, file, NULL, &file->cache,
                             file->ctz.head, file->ctz.size,
                             file->pos-1, &file->block, &(lfs_off_t){0});
                     if (err) {
@@ -3526,10 +5202,32 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
                     lfs_cache_zero(lfs, &file->cache);
                 }
 
+                if (!(file->flags & LFS_F_WRITING)
+                        && lfs_ctz_memocount(file) > 0) {
+                    // forget any blocks we're about to rewrite
+                    lfs_ctz_forget(file, (file->pos > 0)
+                            ? lfs_ctz_index(lfs, &(lfs_off_t){file->pos-1})
+                            : 0);
+                }
+
+                // the last block is copied unless it is full
+                lfs_off_t index = 0;
+                if (file->pos > 0) {
+                    lfs_off_t noff = file->pos - 1;
+                    index = lfs_ctz_index(lfs, &noff)
+                            + ((noff+1 == lfs->cfg->block_size) ? 1 : 0);
+                }
+
                 // extend file with new blocks
                 lfs_alloc_ack(lfs);
-                int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
-                        file->block, file->pos,
+                int err = lfs_file_reserve(lfs, file, index);
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+
+                err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
+                        &file->extent, file->block, file->pos,
                         &file->block, &file->off);
                 if (err) {
                     file->flags |= LFS_F_ERRED;
@@ -3558,6 +5256,7 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
 
             break;
 relocate:
+            LFS_STAT(lfs, relocations, 1);
             err = lfs_file_relocate(lfs, file);
             if (err) {
                 file->flags |= LFS_F_ERRED;
@@ -3567,7 +5266,9 @@ relocate:
 
         file->pos += diff;
         file->off += diff;
-        data += diff;
+        if (data) {
+            data += diff;
+        }
         nsize -= diff;
 
         lfs_alloc_ack(lfs);
@@ -3576,13 +5277,16 @@ relocate:
     return size;
 }
 
-static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
-        const void *buffer, lfs_size_t size) {
-    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+static int lfs_file_prepwrite(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t size) {
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
 
     if (file->flags & LFS_F_READING) {
         // drop any reads
-        int err = lfs_file_flush(lfs, file);
+        err = lfs_file_flush(lfs, file);
         if (err) {
             return err;
         }
@@ -3592,7 +5296,7 @@ static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
         file->pos = file->ctz.size;
     }
 
-    if (file->pos + size > lfs->file_max) {
+    if (size > lfs->file_max || file->pos > lfs->file_max - size) {
         // Larger than file limit?
         return LFS_ERR_FBIG;
     }
@@ -3602,14 +5306,26 @@ static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
         lfs_off_t pos = file->pos;
         file->pos = file->ctz.size;
 
-        while (file->pos < pos) {
-            lfs_ssize_t res = lfs_file_flushedwrite(lfs, file, &(uint8_t){0}, 1);
-            if (res < 0) {
-                return res;
-            }
+        lfs_ssize_t res = lfs_file_flushedwrite(lfs, file,
+                NULL, pos - file->pos);
+        if (res < 0) {
+            return res;
         }
     }
 
+    return 0;
+}
+
+static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    int err = lfs_file_prepwrite(lfs, file, size);
+    if (err) {
+        return err;
+    }
+
     lfs_ssize_t nsize = lfs_file_flushedwrite(lfs, file, buffer, size);
     if (nsize < 0) {
         return nsize;
@@ -3618,10 +5334,44 @@ static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
     file->flags &= ~LFS_F_ERRED;
     return nsize;
 }
+
+static lfs_ssize_t lfs_file_rawwritev(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
+    lfs_size_t size = 0;
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (iov[i].size > lfs->file_max - size) {
+            return LFS_ERR_FBIG;
+        }
+        size += iov[i].size;
+    }
+
+    int err = lfs_file_prepwrite(lfs, file, size);
+    if (err) {
+        return err;
+    }
+
+    // segments are gathered into the file cache, so small segments still
+    // end up in a single prog
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_ssize_t nsize = lfs_file_flushedwrite(lfs, file,
+                iov[i].buffer, iov[i].size);
+        if (nsize < 0) {
+            return nsize;
+        }
+    }
+
+    file->flags &= ~LFS_F_ERRED;
+    return size;
+}
 #endif
 
 static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
         lfs_soff_t off, int whence) {
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
+
     // find new pos
     lfs_off_t npos = file->pos;
     if (whence == LFS_SEEK_SET) {
@@ -3652,8 +5402,9 @@ static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
     }
 
     // if we're only reading and our new offset is still in the file's cache
-    // we can avoid flushing and needing to reread the data
-    if (
+    // we can avoid flushing and needing to reread the data, unless we've
+    // read to the end of a block, in which case our block is behind our pos
+    if (file->off != lfs->cfg->block_size &&
 #ifndef LFS_READONLY
         !(file->flags & LFS_F_WRITING)
 #else
@@ -3686,19 +5437,25 @@ static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
 #ifndef LFS_READONLY
 static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
     LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+    LFS_ASSERT(!(file->flags & LFS_F_LENT));
 
     if (size > LFS_FILE_MAX) {
         return LFS_ERR_INVAL;
     }
 
+    int err = lfs_file_getcache(lfs, file);
+    if (err) {
+        return err;
+    }
+
     lfs_off_t pos = file->pos;
     lfs_off_t oldsize = lfs_file_rawsize(lfs, file);
     if (size < oldsize) {
+        // anything after the new size has already been programmed
+        file->flags &= ~LFS_F_ERASED;
+
         // revert to inline file?
-        if (size <= lfs_min(0x3fe, lfs_min(
-                lfs->cfg->cache_size,
-                (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) / 8))) {
+        if (size <= lfs_file_inlinemax(lfs, file)) {
             // flush+seek to head
             lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_SET);
             if (res < 0) {
@@ -3723,13 +5480,13 @@ static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 
         } else {
             // need to flush since directly changing metadata
-            int err = lfs_file_flush(lfs, file);
+            err = lfs_file_flush(lfs, file);
             if (err) {
                 return err;
             }
 
             // lookup new head in ctz skip list
-            err = lfs_ctz_find(lfs, NULL, &file->cache,
+            err = lfs_ctz_find(lfs, file, NULL, &file->cache,
                     file->ctz.head, file->ctz.size,
                     size-1, &file->block, &(lfs_off_t){0});
             if (err) {
@@ -3750,12 +5507,10 @@ static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             return (int)res;
         }
 
-        // fill with zeros
-        while (file->pos < size) {
-            res = lfs_file_rawwrite(lfs, file, &(uint8_t){0}, 1);
-            if (res < 0) {
-                return (int)res;
-            }
+        // fill with zeros, these go straight into the file's cache
+        res = lfs_file_rawwrite(lfs, file, NULL, size - file->pos);
+        if (res < 0) {
+            return (int)res;
         }
     }
 
@@ -3868,6 +5623,11 @@ static int lfs_rawremove(lfs_t *lfs, const char *path) {
         return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
     }
 
+    lfs_ssize_t used = lfs_dir_getused(lfs, &cwd, lfs_tag_id(tag));
+    if (used < 0) {
+        return used;
+    }
+
     struct lfs_mlist dir;
     dir.next = lfs->mlist;
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
@@ -3910,6 +5670,7 @@ static int lfs_rawremove(lfs_t *lfs, const char *path) {
         return err;
     }
 
+    lfs_alloc_used(lfs, -used);
     lfs->mlist = dir.next;
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
         // fix orphan
@@ -3941,6 +5702,10 @@ static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         return err;
     }
 
+    // moving an entry into a metadata pair we've already traversed would
+    // hide its blocks from any incremental lookahead scan
+    lfs->gc.state = LFS_GC_IDLE;
+
     // find old entry
     lfs_mdir_t oldcwd;
     lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
@@ -4014,6 +5779,16 @@ static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         lfs->mlist = &prevdir;
     }
 
+    // any file we replace frees its blocks
+    lfs_ssize_t used = 0;
+    if (prevtag != LFS_ERR_NOENT
+            && lfs_tag_type3(prevtag) == LFS_TYPE_REG) {
+        used = lfs_dir_getused(lfs, &newcwd, newid);
+        if (used < 0) {
+            return used;
+        }
+    }
+
     if (!samepair) {
         lfs_fs_prepmove(lfs, newoldid, oldcwd.pair);
     }
@@ -4032,6 +5807,8 @@ static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         return err;
     }
 
+    lfs_alloc_used(lfs, -used);
+
     // let commit clean up after move (if we're different! otherwise move
     // logic already fixed it for us)
     if (!samepair && lfs_gstate_hasmove(&lfs->gstate)) {
@@ -4105,6 +5882,12 @@ static lfs_ssize_t lfs_rawgetattr(lfs_t *lfs, const char *path,
 #ifndef LFS_READONLY
 static int lfs_commitattr(lfs_t *lfs, const char *path,
         uint8_t type, const void *buffer, lfs_size_t size) {
+    // drop any mount checkpoint before we write
+    int err = lfs_fs_desuperblock(lfs);
+    if (err) {
+        return err;
+    }
+
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0) {
@@ -4115,7 +5898,7 @@ static int lfs_commitattr(lfs_t *lfs, const char *path,
     if (id == 0x3ff) {
         // special case for root
         id = 0;
-        int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
+        err = lfs_dir_fetch(lfs, &cwd, lfs->root);
         if (err) {
             return err;
         }
@@ -4143,10 +5926,430 @@ static int lfs_rawremoveattr(lfs_t *lfs, const char *path, uint8_t type) {
 }
 #endif
 
+/// Transaction operations ///
+#ifndef LFS_READONLY
+// worst case metadata attributes needed by a transaction, renaming an entry
+// created in the same transaction copies its attributes
+#define LFS_TXN_ATTRS (6*LFS_TXN_MAX)
+
+struct lfs_txn_state {
+    // pending attributes
+    struct lfs_mattr attrs[LFS_TXN_ATTRS];
+    int count;
+    // index of the create for the entry each operation created, or -1
+    int16_t creates[LFS_TXN_MAX];
+    // unmodified metadata pair every operation lands in
+    lfs_mdir_t src;
+    bool found;
+};
+
+static int lfs_txn_namecmp(const char *a, lfs_size_t alen,
+        const char *b, lfs_size_t blen) {
+    // same order as lfs_dir_find_match
+    int res = memcmp(a, b, lfs_min(alen, blen));
+    if (res) {
+        return res;
+    }
+
+    return (alen < blen) ? -1 : (alen > blen);
+}
+
+// map an id through pending attributes, returns false if deleted
+static bool lfs_txn_mapid(const struct lfs_txn_state *state,
+        int off, uint16_t *id) {
+    for (int i = off; i < state->count; i++) {
+        lfs_tag_t tag = state->attrs[i].tag;
+        if (lfs_tag_type3(tag) == LFS_TYPE_CREATE
+                && lfs_tag_id(tag) <= *id) {
+            *id += 1;
+        } else if (lfs_tag_type3(tag) == LFS_TYPE_DELETE) {
+            if (lfs_tag_id(tag) == *id) {
+                return false;
+            } else if (lfs_tag_id(tag) < *id) {
+                *id -= 1;
+            }
+        }
+    }
+
+    return true;
+}
+
+static int lfs_txn_push(struct lfs_txn_state *state,
+        lfs_tag_t tag, const void *buffer) {
+    if (state->count >= LFS_TXN_ATTRS) {
+        return LFS_ERR_NOMEM;
+    }
+
+    state->attrs[state->count] = (struct lfs_mattr){tag, buffer};
+    state->count += 1;
+    return 0;
+}
+
+// find a name as it would be after the pending attributes, returns the
+// entry's name tag, or LFS_ERR_NOENT with the id where it would be created,
+// create is set to the attribute that created the entry, or -1 if the entry
+// is on disk
+static lfs_stag_t lfs_txn_find(lfs_t *lfs, const lfs_txn_t *txn,
+        struct lfs_txn_state *state, const lfs_block_t pair[2],
+        lfs_size_t count, const char *name, uint16_t *id, int *create) {
+    *create = -1;
+    lfs_size_t namelen = strlen(name);
+
+    // created by an earlier operation? only the latest entry with a name
+    // can still exist
+    for (lfs_size_t i = count; i-- > 0;) {
+        const struct lfs_txn_op *op = &txn->ops[i];
+        const char *cname = (op->type == LFS_TXN_RENAME)
+                ? op->newname : op->name;
+        if (state->creates[i] >= 0 && strcmp(cname, name) == 0) {
+            lfs_tag_t tag = state->attrs[state->creates[i]+1].tag;
+            uint16_t cid = lfs_tag_id(tag);
+            if (lfs_txn_mapid(state, state->creates[i]+1, &cid)) {
+                *id = cid;
+                *create = state->creates[i];
+                return tag;
+            }
+            break;
+        }
+    }
+
+    // look up the name on disk
+    lfs_mdir_t dir;
+    dir.tail[0] = pair[0];
+    dir.tail[1] = pair[1];
+    uint16_t did;
+    lfs_stag_t tag = lfs_dir_findname(lfs, &dir, name, namelen, &did);
+    if (tag < 0 && tag != LFS_ERR_NOENT) {
+        return tag;
+    }
+
+    // everything must land in the same metadata pair to commit atomically
+    if (!state->found) {
+        state->src = dir;
+        state->found = true;
+    } else if (!lfs_pair_issync(dir.pair, state->src.pair)) {
+        return LFS_ERR_INVAL;
+    }
+
+    if (tag >= 0) {
+        uint16_t cid = did;
+        if (lfs_txn_mapid(state, 0, &cid)) {
+            *id = cid;
+            return (tag & ~LFS_MKTAG(0, 0x3ff, 0)) | LFS_MKTAG(0, did, 0);
+        }
+
+        // deleted, anything after it is greater
+        did += 1;
+    }
+
+    // doesn't exist, find the first greater entry to keep things sorted
+    uint16_t cid = state->src.count;
+    lfs_txn_mapid(state, 0, &cid);
+    for (uint16_t i = did; i < state->src.count; i++) {
+        uint16_t nid = i;
+        if (lfs_txn_mapid(state, 0, &nid)) {
+            cid = nid;
+            break;
+        }
+    }
+
+    for (lfs_size_t i = 0; i < count; i++) {
+        const struct lfs_txn_op *op = &txn->ops[i];
+        const char *cname = (op->type == LFS_TXN_RENAME)
+                ? op->newname : op->name;
+        if (state->creates[i] < 0
+                || lfs_txn_namecmp(cname, strlen(cname),
+                    name, namelen) <= 0) {
+            continue;
+        }
+
+        uint16_t nid = lfs_tag_id(state->attrs[state->creates[i]].tag);
+        if (lfs_txn_mapid(state, state->creates[i]+1, &nid)) {
+            cid = lfs_min(cid, nid);
+        }
+    }
+
+    *id = cid;
+    return LFS_ERR_NOENT;
+}
+
+static int lfs_txn_rawbegin(lfs_t *lfs, lfs_txn_t *txn, const char *path) {
+    // make sure we are a directory
+    const char *name = path;
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &name, NULL);
+    if (tag < 0) {
+        return tag;
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
+        return LFS_ERR_NOTDIR;
+    }
+
+    txn->path = path;
+    txn->count = 0;
+    return 0;
+}
+
+static bool lfs_txn_isname(const char *name) {
+    return name && name[0] != '\0' && strchr(name, '/') == NULL
+            && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static int lfs_txn_rawadd(lfs_t *lfs, lfs_txn_t *txn,
+        const struct lfs_txn_op *op) {
+    (void)lfs;
+    if (op->type < LFS_TXN_CREATE || op->type > LFS_TXN_REMOVEATTR
+            || !lfs_txn_isname(op->name)
+            || (op->type == LFS_TXN_RENAME && !lfs_txn_isname(op->newname))
+            || (op->type == LFS_TXN_SETATTR && !op->buffer && op->size)) {
+        return LFS_ERR_INVAL;
+    }
+
+    if (txn->count >= LFS_TXN_MAX) {
+        return LFS_ERR_NOMEM;
+    }
+
+    txn->ops[txn->count] = *op;
+    txn->count += 1;
+    return 0;
+}
+
+static int lfs_txn_rawcommit(lfs_t *lfs, lfs_txn_t *txn) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    if (txn->count == 0) {
+        return 0;
+    }
+
+    // find the directory
+    lfs_mdir_t cwd;
+    const char *path = txn->path;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0) {
+        return tag;
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
+        return LFS_ERR_NOTDIR;
+    }
+
+    lfs_block_t pair[2];
+    if (lfs_tag_id(tag) == 0x3ff) {
+        // handle root dir separately
+        pair[0] = lfs->root[0];
+        pair[1] = lfs->root[1];
+    } else {
+        // get dir pair from parent
+        lfs_stag_t res = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
+        if (res < 0) {
+            return res;
+        }
+        lfs_pair_fromle32(pair);
+    }
+
+    // gather every operation into one commit, ids are tracked as they
+    // would be after the earlier operations
+    struct lfs_txn_state state;
+    state.count = 0;
+    state.found = false;
+    bool hasmove = false;
+    bool hasdelete = false;
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        const struct lfs_txn_op *op = &txn->ops[i];
+        state.creates[i] = -1;
+
+        uint16_t id;
+        int create;
+        tag = lfs_txn_find(lfs, txn, &state, pair, i, op->name,
+                &id, &create);
+        if (tag < 0 && !(tag == LFS_ERR_NOENT
+                && op->type == LFS_TXN_CREATE)) {
+            return tag;
+        }
+
+        if (op->type == LFS_TXN_CREATE) {
+            if (tag != LFS_ERR_NOENT) {
+                return LFS_ERR_EXIST;
+            }
+
+            lfs_size_t nlen = strlen(op->name);
+            if (nlen > lfs->name_max) {
+                return LFS_ERR_NAMETOOLONG;
+            }
+
+            state.creates[i] = state.count;
+            err = lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_CREATE, id, 0), NULL);
+            err = err ? err : lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_REG, id, nlen), op->name);
+            err = err ? err : lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, id, 0), NULL);
+        } else if (op->type == LFS_TXN_REMOVE) {
+            // removing directories needs more than one commit
+            if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
+                return LFS_ERR_ISDIR;
+            }
+
+            err = lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_DELETE, id, 0), NULL);
+            hasdelete = true;
+        } else if (op->type == LFS_TXN_SETATTR) {
+            if (op->size > lfs->attr_max) {
+                return LFS_ERR_NOSPC;
+            }
+
+            err = lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_USERATTR + op->attr, id, op->size),
+                    op->buffer);
+        } else if (op->type == LFS_TXN_REMOVEATTR) {
+            err = lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_USERATTR + op->attr, id, 0x3ff),
+                    NULL);
+        } else {
+            uint16_t newid;
+            int prevcreate;
+            lfs_stag_t prevtag = lfs_txn_find(lfs, txn, &state, pair, i,
+                    op->newname, &newid, &prevcreate);
+            if (prevtag < 0 && prevtag != LFS_ERR_NOENT) {
+                return prevtag;
+            }
+
+            lfs_size_t nlen = strlen(op->newname);
+            if (nlen > lfs->name_max) {
+                return LFS_ERR_NAMETOOLONG;
+            }
+
+            if (prevtag != LFS_ERR_NOENT) {
+                if (newid == id) {
+                    // we're renaming to ourselves??
+                    continue;
+                } else if (lfs_tag_type3(prevtag) != lfs_tag_type3(tag)
+                        || lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
+                    // replacing directories needs more than one commit
+                    return LFS_ERR_ISDIR;
+                }
+
+                err = lfs_txn_push(&state,
+                        LFS_MKTAG(LFS_TYPE_DELETE, newid, 0), NULL);
+                if (err) {
+                    return err;
+                }
+                hasdelete = true;
+
+                if (newid < id) {
+                    id -= 1;
+                }
+            }
+
+            int mark = state.count;
+            state.creates[i] = state.count;
+            err = lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL);
+            err = err ? err : lfs_txn_push(&state,
+                    LFS_MKTAG(lfs_tag_type3(tag), newid, nlen),
+                    op->newname);
+            if (err) {
+                return err;
+            }
+
+            if (id >= newid) {
+                id += 1;
+            }
+
+            uint16_t eid;
+            int from;
+            if (create < 0) {
+                // move over all attributes from disk, these don't include
+                // any attributes we've given it so far
+                err = lfs_txn_push(&state,
+                        LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(tag)),
+                        &state.src);
+                eid = lfs_tag_id(tag);
+                from = 0;
+            } else {
+                // entry isn't on disk yet
+                eid = lfs_tag_id(state.attrs[create].tag);
+                from = create+1;
+            }
+
+            // copy over the attributes we've given it so far
+            for (int j = from; j < mark && !err; j++) {
+                lfs_tag_t atag = state.attrs[j].tag;
+                if (lfs_tag_type3(atag) == LFS_TYPE_CREATE) {
+                    eid += (lfs_tag_id(atag) <= eid);
+                } else if (lfs_tag_type3(atag) == LFS_TYPE_DELETE) {
+                    eid -= (lfs_tag_id(atag) < eid);
+                } else if (lfs_tag_id(atag) == eid
+                        && lfs_tag_type1(atag) != LFS_TYPE_NAME) {
+                    // compaction only filters moved attributes against the
+                    // source, so a removed attribute would come back
+                    if (create < 0 && lfs_tag_isdelete(atag)) {
+                        return LFS_ERR_INVAL;
+                    }
+
+                    err = lfs_txn_push(&state,
+                            (atag & ~LFS_MKTAG(0, 0x3ff, 0))
+                                | LFS_MKTAG(0, newid, 0),
+                            state.attrs[j].buffer);
+                }
+            }
+
+            err = err ? err : lfs_txn_push(&state,
+                    LFS_MKTAG(LFS_TYPE_DELETE, id, 0), NULL);
+            hasmove = true;
+        }
+
+        if (err) {
+            return err;
+        }
+    }
+
+    if (state.count == 0) {
+        return 0;
+    }
+
+    if (hasmove) {
+        // moving an entry into a metadata pair we've already traversed
+        // would hide its blocks from any incremental lookahead scan
+        lfs->gc.state = LFS_GC_IDLE;
+    }
+
+    // and commit everything at once, the original metadata pair is kept
+    // around as the source of any moves
+    lfs_mdir_t dir = state.src;
+    err = lfs_dir_commit(lfs, &dir, state.attrs, state.count);
+    if (err) {
+        return err;
+    }
+
+    if (hasdelete) {
+        // we don't look up what removed files were using, count our
+        // blocks again when next asked
+        lfs->used = LFS_BLOCK_NULL;
+    }
+
+    return 0;
+}
+#endif
+
 
 /// Filesystem operations ///
 static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->cfg = cfg;
+    lfs->gc.free.buffer = cfg->gc_lookahead_buffer;
+    lfs->rcaches = cfg->read_cache_buffer;
+    lfs->nindex.buffer = cfg->name_index_buffer;
+    lfs->tcache.buffer = cfg->tag_cache_buffer;
+    lfs->equeue.buffer = cfg->erase_queue_buffer;
+    lfs->fcache.buffer = cfg->file_cache_buffer;
+    lfs->readahead.cache.buffer = cfg->readahead_buffer;
+    lfs->pmap.buffer = cfg->parent_map_buffer;
     int err = 0;
 
 #ifdef LFS_MULTIVERSION
@@ -4164,6 +6367,15 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     // which littlefs currently does not support
     LFS_ASSERT((bool)0x80000000);
 
+#ifdef LFS_THREADSAFE
+    // shared locking needs both halves
+    LFS_ASSERT(!cfg->lock_shared == !cfg->unlock_shared);
+#endif
+
+#ifdef LFS_STATS
+    lfs->stats = (struct lfs_stats){0};
+#endif
+
     // validate that the lfs-cfg sizes were initiated properly before
     // performing any arithmetic logics with them
     LFS_ASSERT(lfs->cfg->read_size != 0);
@@ -4203,35 +6415,156 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
-    // setup program cache
-    if (lfs->cfg->prog_buffer) {
-        lfs->pcache.buffer = lfs->cfg->prog_buffer;
-    } else {
-        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!lfs->pcache.buffer) {
+    // setup program cache
+    if (lfs->cfg->prog_buffer) {
+        lfs->pcache.buffer = lfs->cfg->prog_buffer;
+    } else {
+        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        if (!lfs->pcache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // zero to avoid information leaks
+    lfs_cache_zero(lfs, &lfs->rcache);
+    lfs_cache_zero(lfs, &lfs->pcache);
+
+    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
+    LFS_ASSERT(lfs->cfg->lookahead_size > 0);
+    LFS_ASSERT(lfs->cfg->lookahead_size % 8 == 0 &&
+            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
+    if (lfs->cfg->lookahead_buffer) {
+        lfs->free.buffer = lfs->cfg->lookahead_buffer;
+    } else {
+        lfs->free.buffer = lfs_malloc(lfs->cfg->lookahead_size);
+        if (!lfs->free.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // the second lookahead buffer is only allocated once lfs_fs_gc_step
+    // is used
+    LFS_ASSERT((uintptr_t)lfs->cfg->gc_lookahead_buffer % 4 == 0);
+    lfs->gc.state = LFS_GC_IDLE;
+    lfs->compact.tail[0] = LFS_BLOCK_NULL;
+    lfs->compact.tail[1] = LFS_BLOCK_NULL;
+    lfs->compact.count = 0;
+
+    // setup read cache pool, the cache structs are stored in front of the
+    // cache buffers
+    if (lfs->cfg->read_cache_count) {
+        LFS_ASSERT((uintptr_t)lfs->cfg->read_cache_buffer % 4 == 0);
+        if (lfs->cfg->read_cache_buffer) {
+            lfs->rcaches = lfs->cfg->read_cache_buffer;
+        } else {
+            lfs->rcaches = lfs_malloc(lfs->cfg->read_cache_count
+                    * (sizeof(lfs_cache_t) + lfs->cfg->cache_size));
+            if (!lfs->rcaches) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        uint8_t *buffer = (uint8_t*)&lfs->rcaches[lfs->cfg->read_cache_count];
+        for (lfs_size_t i = 0; i < lfs->cfg->read_cache_count; i++) {
+            lfs->rcaches[i].buffer = &buffer[i*lfs->cfg->cache_size];
+            lfs_cache_zero(lfs, &lfs->rcaches[i]);
+        }
+    }
+
+    // setup name index
+    lfs->nindex.head[0] = LFS_BLOCK_NULL;
+    lfs->nindex.head[1] = LFS_BLOCK_NULL;
+    lfs->nindex.state = LFS_NINDEX_NONE;
+    if (lfs->cfg->name_index_size) {
+        LFS_ASSERT((uintptr_t)lfs->cfg->name_index_buffer % 4 == 0);
+        if (lfs->cfg->name_index_buffer) {
+            lfs->nindex.buffer = lfs->cfg->name_index_buffer;
+        } else {
+            lfs->nindex.buffer = lfs_malloc(lfs->cfg->name_index_size);
+            if (!lfs->nindex.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
+    // setup tag cache
+    lfs->tcache.block = LFS_BLOCK_NULL;
+    lfs->tcache.count = 0;
+    if (lfs->cfg->tag_cache_size) {
+        LFS_ASSERT((uintptr_t)lfs->cfg->tag_cache_buffer % 4 == 0);
+        if (lfs->cfg->tag_cache_buffer) {
+            lfs->tcache.buffer = lfs->cfg->tag_cache_buffer;
+        } else {
+            lfs->tcache.buffer = lfs_malloc(lfs->cfg->tag_cache_size);
+            if (!lfs->tcache.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
+    // setup erase queue
+    lfs->equeue.off = 0;
+    lfs->equeue.count = 0;
+    lfs->equeue.erased = 0;
+    lfs->equeue.size = lfs->cfg->erase_queue_depth + 1;
+    if (lfs->cfg->erase_queue_depth) {
+        LFS_ASSERT(!lfs->cfg->erase_submit == !lfs->cfg->erase_wait);
+        if (!lfs->cfg->erase_queue_buffer) {
+            lfs->equeue.buffer = lfs_malloc(
+                    lfs->equeue.size * sizeof(lfs_block_t));
+            if (!lfs->equeue.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
+    // count blocks in use the first time we're asked
+    lfs->used = LFS_BLOCK_NULL;
+
+    // setup file cache pool
+    lfs->fcache.next = 0;
+    if (lfs->cfg->file_cache_count && !lfs->cfg->file_cache_buffer) {
+        lfs->fcache.buffer = lfs_malloc(
+                lfs->cfg->file_cache_count * lfs->cfg->cache_size);
+        if (!lfs->fcache.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
         }
     }
 
-    // zero to avoid information leaks
-    lfs_cache_zero(lfs, &lfs->rcache);
-    lfs_cache_zero(lfs, &lfs->pcache);
-
-    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
-    LFS_ASSERT(lfs->cfg->lookahead_size > 0);
-    LFS_ASSERT(lfs->cfg->lookahead_size % 8 == 0 &&
-            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
-    if (lfs->cfg->lookahead_buffer) {
-        lfs->free.buffer = lfs->cfg->lookahead_buffer;
-    } else {
-        lfs->free.buffer = lfs_malloc(lfs->cfg->lookahead_size);
-        if (!lfs->free.buffer) {
+    // setup readahead buffer
+    LFS_ASSERT(lfs->cfg->readahead_size % lfs->cfg->read_size == 0);
+    LFS_ASSERT(lfs->cfg->readahead_size <= lfs->cfg->block_size);
+    lfs->readahead.file = NULL;
+    lfs_cache_drop(lfs, &lfs->readahead.cache);
+    if (lfs->cfg->readahead_size && !lfs->cfg->readahead_buffer) {
+        lfs->readahead.cache.buffer = lfs_malloc(lfs->cfg->readahead_size);
+        if (!lfs->readahead.cache.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
         }
     }
 
+    // setup parent map
+    lfs->pmap.count = 0;
+    lfs->pmap.state = LFS_PMAP_NONE;
+    if (lfs->cfg->parent_map_size) {
+        LFS_ASSERT((uintptr_t)lfs->cfg->parent_map_buffer % 4 == 0);
+        if (!lfs->cfg->parent_map_buffer) {
+            lfs->pmap.buffer = lfs_malloc(lfs->cfg->parent_map_size);
+            if (!lfs->pmap.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
     // check that the size limits are sane
     LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
     lfs->name_max = lfs->cfg->name_max;
@@ -4253,6 +6586,28 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
 
     LFS_ASSERT(lfs->cfg->metadata_max <= lfs->cfg->block_size);
 
+    // the largest inline file is limited by our file caches, and the
+    // metadata block it lives in
+    LFS_ASSERT(lfs->cfg->inline_max == (lfs_size_t)-1
+            || lfs->cfg->inline_max <= lfs_min(0x3fe, lfs->cfg->cache_size));
+    LFS_ASSERT(lfs->cfg->inline_max == (lfs_size_t)-1
+            || lfs->cfg->inline_max <= ((lfs->cfg->metadata_max)
+                ? lfs->cfg->metadata_max
+                : lfs->cfg->block_size)/8);
+    lfs->inline_max = lfs->cfg->inline_max;
+    if (lfs->inline_max == (lfs_size_t)-1) {
+        lfs->inline_max = 0;
+    } else if (lfs->inline_max == 0) {
+        lfs->inline_max = lfs_min(0x3fe, lfs_min(
+                lfs->cfg->cache_size,
+                ((lfs->cfg->metadata_max)
+                    ? lfs->cfg->metadata_max
+                    : lfs->cfg->block_size)/8));
+    }
+    LFS_ASSERT(lfs->cfg->compact_thresh <= ((lfs->cfg->metadata_max)
+            ? lfs->cfg->metadata_max
+            : lfs->cfg->block_size));
+
     // setup default state
     lfs->root[0] = LFS_BLOCK_NULL;
     lfs->root[1] = LFS_BLOCK_NULL;
@@ -4282,8 +6637,42 @@ static int lfs_deinit(lfs_t *lfs) {
         lfs_free(lfs->pcache.buffer);
     }
 
-    if (!lfs->cfg->lookahead_buffer) {
-        lfs_free(lfs->free.buffer);
+    // note the lookahead buffers may have been swapped by the allocator
+    uint32_t *lookaheads[2] = {lfs->free.buffer, lfs->gc.free.buffer};
+    for (int i = 0; i < 2; i++) {
+        if (lookaheads[i]
+                && lookaheads[i] != lfs->cfg->lookahead_buffer
+                && lookaheads[i] != lfs->cfg->gc_lookahead_buffer) {
+            lfs_free(lookaheads[i]);
+        }
+    }
+
+    if (lfs->cfg->read_cache_count && !lfs->cfg->read_cache_buffer) {
+        lfs_free(lfs->rcaches);
+    }
+
+    if (lfs->cfg->name_index_size && !lfs->cfg->name_index_buffer) {
+        lfs_free(lfs->nindex.buffer);
+    }
+
+    if (lfs->cfg->tag_cache_size && !lfs->cfg->tag_cache_buffer) {
+        lfs_free(lfs->tcache.buffer);
+    }
+
+    if (lfs->cfg->erase_queue_depth && !lfs->cfg->erase_queue_buffer) {
+        lfs_free(lfs->equeue.buffer);
+    }
+
+    if (lfs->cfg->file_cache_count && !lfs->cfg->file_cache_buffer) {
+        lfs_free(lfs->fcache.buffer);
+    }
+
+    if (lfs->cfg->readahead_size && !lfs->cfg->readahead_buffer) {
+        lfs_free(lfs->readahead.cache.buffer);
+    }
+
+    if (lfs->cfg->parent_map_size && !lfs->cfg->parent_map_buffer) {
+        lfs_free(lfs->pmap.buffer);
     }
 
     return 0;
@@ -4304,6 +6693,7 @@ static int lfs_rawformat(lfs_t *lfs, const struct lfs_config *cfg) {
         lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size,
                 lfs->cfg->block_count);
         lfs->free.i = 0;
+        lfs->free.extent = 0;
         lfs_alloc_ack(lfs);
 
         // create root dir
@@ -4410,20 +6800,23 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
             }
             lfs_superblock_fromle32(&superblock);
 
-            // check version
+            // check version, we can mount newer minor versions than we
+            // write as long as we understand them
             uint16_t major_version = (0xffff & (superblock.version >> 16));
             uint16_t minor_version = (0xffff & (superblock.version >>  0));
+            uint16_t max_minor_version = 0xffff & lfs_fs_disk_version_max(lfs);
             if (major_version != lfs_fs_disk_version_major(lfs)
-                    || minor_version > lfs_fs_disk_version_minor(lfs)) {
+                    || minor_version > max_minor_version) {
                 LFS_ERROR("Invalid version "
                         "v%"PRIu16".%"PRIu16" != v%"PRIu16".%"PRIu16,
                         major_version,
                         minor_version,
                         lfs_fs_disk_version_major(lfs),
-                        lfs_fs_disk_version_minor(lfs));
+                        max_minor_version);
                 err = LFS_ERR_INVAL;
                 goto cleanup;
             }
+            lfs->disk_version = superblock.version;
 
             // found older minor version? set an in-device only bit in the
             // gstate so we know we need to rewrite the superblock before
@@ -4485,6 +6878,32 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
                 err = LFS_ERR_INVAL;
                 goto cleanup;
             }
+
+            // found a checkpoint from a clean unmount? this must be dropped
+            // before the first write, which we piggyback on the superblock
+            // rewrite
+            lfs_checkpoint_t checkpoint;
+            tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, sizeof(checkpoint)),
+                    &checkpoint);
+            if (tag < 0 && tag != LFS_ERR_NOENT) {
+                err = tag;
+                goto cleanup;
+            }
+
+            if (tag != LFS_ERR_NOENT) {
+                lfs_fs_prepsuperblock(lfs, true);
+
+                // the checkpoint has the gstate of every metadata pair, so
+                // we can skip the rest of the scan
+                if (lfs_fs_usecheckpoint(lfs)
+                        && lfs_tag_size(tag) == sizeof(checkpoint)) {
+                    lfs_checkpoint_fromle32(&checkpoint);
+                    lfs_gstate_xor(&lfs->gstate, &checkpoint.gstate);
+                    lfs->seed = checkpoint.seed;
+                    break;
+                }
+            }
         }
 
         // has gstate?
@@ -4515,54 +6934,162 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->free.off = lfs->seed % lfs->cfg->block_count;
     lfs_alloc_drop(lfs);
 
+#ifndef LFS_READONLY
+    // or pick up where we left off if a free extent was recorded on disk,
+    // otherwise any recorded extent is cleared on the next commit
+    if (lfs_alloc_useextents(lfs)
+            && lfs_gstate_hasextent(&lfs->gdisk, lfs->cfg->block_count)) {
+        lfs->free.off = lfs->gdisk.extent[0];
+        lfs->free.extent = lfs->gdisk.extent[1];
+        lfs_gstate_setextent(&lfs->gstate,
+                lfs->gdisk.extent[0], lfs->gdisk.extent[1]);
+    }
+#endif
+
     return 0;
 
 cleanup:
-    lfs_rawunmount(lfs);
+    lfs_deinit(lfs);
     return err;
 }
 
 static int lfs_rawunmount(lfs_t *lfs) {
+#ifndef LFS_READONLY
+    // finish any erases we queued, the blocks are still free on disk
+    int err = lfs_alloc_erasedrain(lfs);
+    if (err) {
+        lfs_deinit(lfs);
+        return err;
+    }
+
+    // write a checkpoint so the next mount can skip the scan, unless the
+    // checkpoint we mounted with is still valid, if we're out of space we
+    // just go without
+    if (lfs_fs_usecheckpoint(lfs)
+            && !lfs_gstate_needssuperblock(&lfs->gstate)) {
+        err = lfs_fs_checkpoint(lfs);
+        if (err && err != LFS_ERR_NOSPC) {
+            lfs_deinit(lfs);
+            return err;
+        }
+    }
+#endif
+
     return lfs_deinit(lfs);
 }
 
 
 /// Filesystem filesystem operations ///
 static int lfs_fs_rawstat(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
-    // if the superblock is up-to-date, we must be on the most recent
-    // minor version of littlefs
-    if (!lfs_gstate_needssuperblock(&lfs->gstate)) {
-        fsinfo->disk_version = lfs_fs_disk_version(lfs);
+    // we keep track of the on-disk version, which may be newer or older
+    // than the version we write
+    fsinfo->disk_version = lfs->disk_version;
 
-    // otherwise we need to read the minor version on disk
-    } else {
-        // fetch the superblock
-        lfs_mdir_t dir;
-        int err = lfs_dir_fetch(lfs, &dir, lfs->root);
+    // other on-disk configuration, we cache all of these for internal use
+    fsinfo->name_max = lfs->name_max;
+    fsinfo->file_max = lfs->file_max;
+    fsinfo->attr_max = lfs->attr_max;
+
+#ifdef LFS_STATS
+    fsinfo->stats = lfs->stats;
+#endif
+
+    return 0;
+}
+
+static int lfs_fs_traversedir(lfs_t *lfs, lfs_mdir_t *dir,
+        const lfs_block_t pair[2],
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        bool includeorphans) {
+    for (int i = 0; i < 2; i++) {
+        int err = cb(data, pair[i]);
         if (err) {
             return err;
         }
+    }
+
+    // iterate through ids in directory
+    int err = lfs_dir_fetch(lfs, dir, pair);
+    if (err) {
+        return err;
+    }
 
-        lfs_superblock_t superblock;
-        lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                &superblock);
+    for (uint16_t id = 0; id < dir->count; id++) {
+        struct lfs_ctz ctz;
+        lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
         if (tag < 0) {
+            if (tag == LFS_ERR_NOENT) {
+                continue;
+            }
             return tag;
         }
-        lfs_superblock_fromle32(&superblock);
+        lfs_ctz_fromle32(&ctz);
 
-        // read the on-disk version
-        fsinfo->disk_version = superblock.version;
+        if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
+            err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+                    ctz.head, ctz.size, cb, data);
+            if (err) {
+                return err;
+            }
+        } else if (includeorphans &&
+                lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
+            for (int i = 0; i < 2; i++) {
+                err = cb(data, (&ctz.head)[i]);
+                if (err) {
+                    return err;
+                }
+            }
+        }
     }
 
-    // other on-disk configuration, we cache all of these for internal use
-    fsinfo->name_max = lfs->name_max;
-    fsinfo->file_max = lfs->file_max;
-    fsinfo->attr_max = lfs->attr_max;
+    return 0;
+}
+
+#ifndef LFS_READONLY
+static int lfs_fs_traversefiles(lfs_t *lfs,
+        int (*cb)(void *data, lfs_block_t block), void *data) {
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type != LFS_TYPE_REG) {
+            continue;
+        }
+
+        if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
+            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+                    f->ctz.head, f->ctz.size, cb, data);
+            if (err) {
+                return err;
+            }
+        }
+
+        if ((f->flags & LFS_F_WRITING) && !(f->flags & LFS_F_INLINE)) {
+            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+                    f->block, f->pos, cb, data);
+            if (err) {
+                return err;
+            }
+        }
+
+        for (lfs_size_t i = 0; i < f->extent.count; i++) {
+            int err = cb(data, f->extent.block + i);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    // blocks queued for erasing are also reserved for files
+    for (lfs_size_t i = 0; i < lfs->equeue.count; i++) {
+        int err = cb(data, lfs->equeue.buffer[
+                (lfs->equeue.off + i) % lfs->equeue.size]);
+        if (err) {
+            return err;
+        }
+    }
 
     return 0;
 }
+#endif
 
 int lfs_fs_rawtraverse(lfs_t *lfs,
         int (*cb)(void *data, lfs_block_t block), void *data,
@@ -4600,71 +7127,18 @@ int lfs_fs_rawtraverse(lfs_t *lfs,
         }
         tortoise_i += 1;
 
-        for (int i = 0; i < 2; i++) {
-            int err = cb(data, dir.tail[i]);
-            if (err) {
-                return err;
-            }
-        }
-
-        // iterate through ids in directory
-        int err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        int err = lfs_fs_traversedir(lfs, &dir, dir.tail,
+                cb, data, includeorphans);
         if (err) {
             return err;
         }
-
-        for (uint16_t id = 0; id < dir.count; id++) {
-            struct lfs_ctz ctz;
-            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
-            if (tag < 0) {
-                if (tag == LFS_ERR_NOENT) {
-                    continue;
-                }
-                return tag;
-            }
-            lfs_ctz_fromle32(&ctz);
-
-            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
-                err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
-                        ctz.head, ctz.size, cb, data);
-                if (err) {
-                    return err;
-                }
-            } else if (includeorphans &&
-                    lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
-                for (int i = 0; i < 2; i++) {
-                    err = cb(data, (&ctz.head)[i]);
-                    if (err) {
-                        return err;
-                    }
-                }
-            }
-        }
     }
 
 #ifndef LFS_READONLY
     // iterate over any open files
-    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
-        if (f->type != LFS_TYPE_REG) {
-            continue;
-        }
-
-        if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
-                    f->ctz.head, f->ctz.size, cb, data);
-            if (err) {
-                return err;
-            }
-        }
-
-        if ((f->flags & LFS_F_WRITING) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
-                    f->block, f->pos, cb, data);
-            if (err) {
-                return err;
-            }
-        }
+    int err = lfs_fs_traversefiles(lfs, cb, data);
+    if (err) {
+        return err;
     }
 #endif
 
@@ -4709,17 +7183,89 @@ static int lfs_fs_pred(lfs_t *lfs,
 #endif
 
 #ifndef LFS_READONLY
-struct lfs_fs_parent_match {
+struct lfs_fs_parent_match {
+    lfs_t *lfs;
+    const lfs_block_t pair[2];
+};
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_parent_match(void *data,
+        lfs_tag_t tag, const void *buffer) {
+    struct lfs_fs_parent_match *find = data;
+    lfs_t *lfs = find->lfs;
+    const struct lfs_diskoff *disk = buffer;
+    (void)tag;
+
+    lfs_block_t child[2];
+    int err = lfs_bd_read(lfs,
+            &lfs->pcache, &lfs->rcache, lfs->cfg->block_size,
+            disk->block, disk->off, &child, sizeof(child));
+    if (err) {
+        return err;
+    }
+
+    lfs_pair_fromle32(child);
+    return (lfs_pair_cmp(child, find->pair) == 0) ? LFS_CMP_EQ : LFS_CMP_LT;
+}
+#endif
+
+#ifndef LFS_READONLY
+static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t pair[2],
+        lfs_mdir_t *parent) {
+    // use fetchmatch with callback to find pairs
+    parent->tail[0] = 0;
+    parent->tail[1] = 1;
+    lfs_block_t tortoise[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
+    lfs_size_t tortoise_i = 1;
+    lfs_size_t tortoise_period = 1;
+    while (!lfs_pair_isnull(parent->tail)) {
+        // detect cycles with Brent's algorithm
+        if (lfs_pair_issync(parent->tail, tortoise)) {
+            LFS_WARN("Cycle detected in tail list");
+            return LFS_ERR_CORRUPT;
+        }
+        if (tortoise_i == tortoise_period) {
+            tortoise[0] = parent->tail[0];
+            tortoise[1] = parent->tail[1];
+            tortoise_i = 0;
+            tortoise_period *= 2;
+        }
+        tortoise_i += 1;
+
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, parent->tail,
+                LFS_MKTAG(0x7ff, 0, 0x3ff),
+                LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
+                NULL,
+                lfs_fs_parent_match, &(struct lfs_fs_parent_match){
+                    lfs, {pair[0], pair[1]}});
+        if (tag && tag != LFS_ERR_NOENT) {
+            return tag;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+#endif
+
+#ifndef LFS_READONLY
+// the parent map records every directory entry found in the metadata logs,
+// in list order, along with the metadata pair it was found in, outdated
+// entries are included so the map only narrows down where to look
+struct lfs_pmap_entry {
+    lfs_block_t child[2];
+    lfs_block_t parent[2];
+};
+
+struct lfs_pmap_record {
     lfs_t *lfs;
-    const lfs_block_t pair[2];
+    const lfs_block_t *parent;
 };
-#endif
 
-#ifndef LFS_READONLY
-static int lfs_fs_parent_match(void *data,
+static int lfs_pmap_record(void *data,
         lfs_tag_t tag, const void *buffer) {
-    struct lfs_fs_parent_match *find = data;
-    lfs_t *lfs = find->lfs;
+    struct lfs_pmap_record *record = data;
+    lfs_t *lfs = record->lfs;
     const struct lfs_diskoff *disk = buffer;
     (void)tag;
 
@@ -4730,36 +7276,104 @@ static int lfs_fs_parent_match(void *data,
     if (err) {
         return err;
     }
-
     lfs_pair_fromle32(child);
-    return (lfs_pair_cmp(child, find->pair) == 0) ? LFS_CMP_EQ : LFS_CMP_LT;
+
+    struct lfs_pmap_entry *entries = (struct lfs_pmap_entry*)lfs->pmap.buffer;
+    if (lfs->pmap.count > 0
+            && lfs_pair_issync(entries[lfs->pmap.count-1].parent,
+                record->parent)
+            && lfs_pair_issync(entries[lfs->pmap.count-1].child, child)) {
+        // already recorded
+        return LFS_CMP_LT;
+    }
+
+    if (lfs->pmap.count == lfs->cfg->parent_map_size
+            / sizeof(struct lfs_pmap_entry)) {
+        lfs->pmap.state = LFS_PMAP_FULL;
+        return LFS_CMP_LT;
+    }
+
+    entries[lfs->pmap.count].child[0] = child[0];
+    entries[lfs->pmap.count].child[1] = child[1];
+    entries[lfs->pmap.count].parent[0] = record->parent[0];
+    entries[lfs->pmap.count].parent[1] = record->parent[1];
+    lfs->pmap.count += 1;
+    return LFS_CMP_LT;
 }
-#endif
 
-#ifndef LFS_READONLY
-static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t pair[2],
-        lfs_mdir_t *parent) {
-    // use fetchmatch with callback to find pairs
-    parent->tail[0] = 0;
-    parent->tail[1] = 1;
+static int lfs_pmap_build(lfs_t *lfs) {
+    lfs->pmap.count = 0;
+    lfs->pmap.state = LFS_PMAP_VALID;
+
+    lfs_mdir_t dir = {.tail = {0, 1}};
     lfs_block_t tortoise[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
     lfs_size_t tortoise_i = 1;
     lfs_size_t tortoise_period = 1;
-    while (!lfs_pair_isnull(parent->tail)) {
+    while (!lfs_pair_isnull(dir.tail)) {
         // detect cycles with Brent's algorithm
-        if (lfs_pair_issync(parent->tail, tortoise)) {
+        if (lfs_pair_issync(dir.tail, tortoise)) {
             LFS_WARN("Cycle detected in tail list");
+            lfs->pmap.state = LFS_PMAP_NONE;
             return LFS_ERR_CORRUPT;
         }
         if (tortoise_i == tortoise_period) {
-            tortoise[0] = parent->tail[0];
-            tortoise[1] = parent->tail[1];
+            tortoise[0] = dir.tail[0];
+            tortoise[1] = dir.tail[1];
             tortoise_i = 0;
             tortoise_period *= 2;
         }
         tortoise_i += 1;
 
-        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, parent->tail,
+        lfs_block_t pair[2] = {dir.tail[0], dir.tail[1]};
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, &dir, pair,
+                LFS_MKTAG(0x7ff, 0, 0x3ff),
+                LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
+                NULL,
+                lfs_pmap_record, &(struct lfs_pmap_record){lfs, pair});
+        if (tag < 0 && tag != LFS_ERR_NOENT) {
+            lfs->pmap.state = LFS_PMAP_NONE;
+            return tag;
+        }
+
+        if (lfs->pmap.state == LFS_PMAP_FULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// forget the parent map after a commit, commits may relocate or split
+// metadata pairs, unless we already know the filesystem doesn't fit
+static void lfs_pmap_drop(lfs_t *lfs) {
+    if (lfs->pmap.state == LFS_PMAP_VALID) {
+        lfs->pmap.state = LFS_PMAP_NONE;
+    }
+}
+
+// find the parent of a directory like lfs_fs_parent, but only fetch the
+// metadata pairs the parent map says could hold its entry
+static lfs_stag_t lfs_pmap_parent(lfs_t *lfs, const lfs_block_t pair[2],
+        lfs_mdir_t *parent) {
+    if (lfs->cfg->parent_map_size && lfs->pmap.state == LFS_PMAP_NONE) {
+        int err = lfs_pmap_build(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (lfs->pmap.state != LFS_PMAP_VALID) {
+        return lfs_fs_parent(lfs, pair, parent);
+    }
+
+    const struct lfs_pmap_entry *entries
+            = (const struct lfs_pmap_entry*)lfs->pmap.buffer;
+    for (lfs_size_t i = 0; i < lfs->pmap.count; i++) {
+        if (lfs_pair_cmp(entries[i].child, pair) != 0) {
+            continue;
+        }
+
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, entries[i].parent,
                 LFS_MKTAG(0x7ff, 0, 0x3ff),
                 LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
                 NULL,
@@ -4817,9 +7431,11 @@ static int lfs_fs_desuperblock(lfs_t *lfs) {
         return err;
     }
 
-    // write a new superblock
+    // write a new superblock, but never move back to an older minor
+    // version, older drivers could drop parts of the gstate we wrote
+    uint32_t version = lfs_max(lfs->disk_version, lfs_fs_disk_version(lfs));
     lfs_superblock_t superblock = {
-        .version     = lfs_fs_disk_version(lfs),
+        .version     = version,
         .block_size  = lfs->cfg->block_size,
         .block_count = lfs->cfg->block_count,
         .name_max    = lfs->name_max,
@@ -4827,19 +7443,68 @@ static int lfs_fs_desuperblock(lfs_t *lfs) {
         .attr_max    = lfs->attr_max,
     };
 
+    // and drop any checkpoint, it's outdated as soon as we write
     lfs_superblock_tole32(&superblock);
     err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                &superblock}));
+                &superblock},
+            {LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, 0x3ff), NULL}));
     if (err) {
         return err;
     }
 
+    lfs->disk_version = version;
     lfs_fs_prepsuperblock(lfs, false);
     return 0;
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_fs_checkpoint(lfs_t *lfs) {
+    lfs_mdir_t root;
+    int err = lfs_dir_fetch(lfs, &root, lfs->root);
+    if (err) {
+        return err;
+    }
+
+    // allocating while compacting may change the gstate, so check that what
+    // we wrote matches the gstate on disk, if we can't get a match the
+    // checkpoint is left deleted
+    for (int i = 0; i < 3; i++) {
+        lfs_checkpoint_t checkpoint = {lfs->gstate, lfs->seed};
+        checkpoint.gstate.tag &= ~LFS_MKTAG(0, 0, 0x3ff);
+        lfs_checkpoint_tole32(&checkpoint);
+        err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0,
+                    (i < 2) ? sizeof(checkpoint) : 0x3ff), &checkpoint}));
+        if (err) {
+            return err;
+        }
+
+        if (i == 2) {
+            break;
+        }
+
+        lfs_checkpoint_t disk;
+        lfs_stag_t tag = lfs_dir_get(lfs, &root, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, sizeof(disk)), &disk);
+        if (tag < 0 && tag != LFS_ERR_NOENT) {
+            return tag;
+        }
+
+        checkpoint = (lfs_checkpoint_t){lfs->gdisk, lfs->seed};
+        checkpoint.gstate.tag &= ~LFS_MKTAG(0, 0, 0x3ff);
+        lfs_checkpoint_tole32(&checkpoint);
+        if (tag != LFS_ERR_NOENT
+                && memcmp(&disk, &checkpoint, sizeof(disk)) == 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_fs_demove(lfs_t *lfs) {
     if (!lfs_gstate_hasmove(&lfs->gdisk)) {
@@ -4872,16 +7537,14 @@ static int lfs_fs_demove(lfs_t *lfs) {
         return err;
     }
 
+    // until now both entries counted the moved file's blocks
+    lfs->used = LFS_BLOCK_NULL;
     return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
-    if (!lfs_gstate_hasorphans(&lfs->gstate)) {
-        return 0;
-    }
-
+static int lfs_fs_fixorphans(lfs_t *lfs, bool powerloss) {
     // Check for orphans in two separate passes:
     // - 1 for half-orphans (relocations)
     // - 2 for full-orphans (removes/renames)
@@ -4892,6 +7555,8 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
     //
     int pass = 0;
     while (pass < 2) {
+        LFS_STAT(lfs, deorphans, 1);
+
         // Fix any orphans
         lfs_mdir_t pdir = {.split = true, .tail = {0, 1}};
         lfs_mdir_t dir;
@@ -4908,7 +7573,7 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
             if (!pdir.split) {
                 // check if we have a parent
                 lfs_mdir_t parent;
-                lfs_stag_t tag = lfs_fs_parent(lfs, pdir.tail, &parent);
+                lfs_stag_t tag = lfs_pmap_parent(lfs, pdir.tail, &parent);
                 if (tag < 0 && tag != LFS_ERR_NOENT) {
                     return tag;
                 }
@@ -4948,6 +7613,7 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
                                 {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8),
                                     pair}));
                         lfs_pair_fromle32(pair);
+                        lfs_pmap_drop(lfs);
                         if (state < 0) {
                             return state;
                         }
@@ -4982,76 +7648,393 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
                             {LFS_MKTAG(LFS_TYPE_TAIL + dir.split, 0x3ff, 8),
                                 dir.tail}));
                     lfs_pair_fromle32(dir.tail);
+                    lfs_pmap_drop(lfs);
                     if (state < 0) {
                         return state;
                     }
 
+                    lfs_alloc_used(lfs, -2);
+
                     // did our commit create more orphans?
                     if (state == LFS_OK_ORPHANED) {
                         moreorphans = true;
                     }
 
-                    // refetch tail
-                    continue;
+                    // refetch tail
+                    continue;
+                }
+            }
+
+            pdir = dir;
+        }
+
+        pass = moreorphans ? 0 : pass+1;
+    }
+
+    // mark orphans as fixed
+    return lfs_fs_preporphans(lfs, -lfs_gstate_getorphans(&lfs->gstate));
+}
+
+static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
+    if (!lfs_gstate_hasorphans(&lfs->gstate)) {
+        return 0;
+    }
+
+    // the parent map only lives as long as one deorphan
+    lfs->pmap.state = LFS_PMAP_NONE;
+
+    LFS_EVENT(lfs, LFS_EVENT_DEORPHAN_BEGIN);
+    int err = lfs_fs_fixorphans(lfs, powerloss);
+    LFS_EVENT(lfs, LFS_EVENT_DEORPHAN_END);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_forceconsistency(lfs_t *lfs) {
+    int err = lfs_fs_desuperblock(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_demove(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_deorphan(lfs, true);
+    if (err) {
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_rawmkconsistent(lfs_t *lfs) {
+    // lfs_fs_forceconsistency does most of the work here
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // do we have any pending gstate?
+    lfs_gstate_t delta = {0};
+    lfs_gstate_xor(&delta, &lfs->gdisk);
+    lfs_gstate_xor(&delta, &lfs->gstate);
+    if (!lfs_gstate_iszero(&delta)) {
+        // lfs_dir_commit will implicitly write out any pending gstate
+        lfs_mdir_t root;
+        err = lfs_dir_fetch(lfs, &root, lfs->root);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_rawgc_step(lfs_t *lfs, lfs_size_t budget) {
+    if (lfs->gc.state == LFS_GC_READY) {
+        return 0;
+    }
+
+    if (lfs->gc.state == LFS_GC_IDLE) {
+        if (!lfs->gc.free.buffer) {
+            lfs->gc.free.buffer = lfs_malloc(lfs->cfg->lookahead_size);
+            if (!lfs->gc.free.buffer) {
+                return LFS_ERR_NOMEM;
+            }
+        }
+
+        // the next window starts where the allocator runs out of blocks,
+        // and like any window must stop before blocks allocated since the
+        // last ack
+        lfs_block_t left = (lfs->free.size - lfs->free.i) + lfs->free.extent;
+        lfs_block_t ack = lfs->free.ack - left;
+        lfs->gc.free.off = (lfs->free.off + lfs->free.size + lfs->free.extent)
+                % lfs->cfg->block_count;
+        lfs->gc.free.size = lfs_min(8*lfs->cfg->lookahead_size, ack);
+        lfs->gc.free.extent = (lfs_alloc_useextents(lfs))
+                ? ack - lfs->gc.free.size
+                : 0;
+        memset(lfs->gc.free.buffer, 0, lfs->cfg->lookahead_size);
+
+        lfs->gc.tail[0] = 0;
+        lfs->gc.tail[1] = 1;
+        lfs->gc.count = 0;
+        lfs->gc.state = LFS_GC_SCANNING;
+    }
+
+    while (!lfs_pair_isnull(lfs->gc.tail)) {
+        if (budget == 0) {
+            return 1;
+        }
+        budget -= 1;
+
+        // we can't have more metadata pairs than half our blocks
+        if (lfs->gc.count >= lfs->cfg->block_count/2) {
+            LFS_WARN("Cycle detected in tail list");
+            lfs->gc.state = LFS_GC_IDLE;
+            return LFS_ERR_CORRUPT;
+        }
+        lfs->gc.count += 1;
+
+        lfs_mdir_t dir;
+        int err = lfs_fs_traversedir(lfs, &dir, lfs->gc.tail,
+                lfs_alloc_gclookahead, lfs, true);
+        if (err) {
+            lfs->gc.state = LFS_GC_IDLE;
+            return err;
+        }
+
+        lfs->gc.tail[0] = dir.tail[0];
+        lfs->gc.tail[1] = dir.tail[1];
+    }
+
+    // finish with any open files
+    int err = lfs_fs_traversefiles(lfs, lfs_alloc_gclookahead, lfs);
+    if (err) {
+        lfs->gc.state = LFS_GC_IDLE;
+        return err;
+    }
+
+    lfs->gc.state = LFS_GC_READY;
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_rawcompact_step(lfs_t *lfs, lfs_size_t budget) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t metadata_max = (lfs->cfg->metadata_max)
+            ? lfs->cfg->metadata_max
+            : lfs->cfg->block_size;
+    lfs_size_t thresh = (lfs->cfg->compact_thresh)
+            ? lfs->cfg->compact_thresh
+            : metadata_max - metadata_max/8;
+
+    if (lfs_pair_isnull(lfs->compact.tail)) {
+        lfs->compact.tail[0] = 0;
+        lfs->compact.tail[1] = 1;
+        lfs->compact.count = 0;
+    }
+
+    while (!lfs_pair_isnull(lfs->compact.tail)) {
+        if (budget == 0) {
+            return 1;
+        }
+        budget -= 1;
+
+        // we can't have more metadata pairs than half our blocks
+        if (lfs->compact.count >= lfs->cfg->block_count/2) {
+            LFS_WARN("Cycle detected in tail list");
+            lfs->compact.tail[0] = LFS_BLOCK_NULL;
+            lfs->compact.tail[1] = LFS_BLOCK_NULL;
+            return LFS_ERR_CORRUPT;
+        }
+        lfs->compact.count += 1;
+
+        lfs_mdir_t mdir;
+        err = lfs_dir_fetch(lfs, &mdir, lfs->compact.tail);
+        if (err) {
+            lfs->compact.tail[0] = LFS_BLOCK_NULL;
+            lfs->compact.tail[1] = LFS_BLOCK_NULL;
+            return err;
+        }
+
+        // compact if the next commit would, because the mdir is full or
+        // not erased, compaction then relocates if block_cycles says so
+        if (!mdir.erased || mdir.off > thresh) {
+            // the easiest way to trigger a compaction is to mark the mdir
+            // as unerased and commit nothing
+            lfs_alloc_ack(lfs);
+            mdir.erased = false;
+            err = lfs_dir_commit(lfs, &mdir, NULL, 0);
+            if (err) {
+                lfs->compact.tail[0] = LFS_BLOCK_NULL;
+                lfs->compact.tail[1] = LFS_BLOCK_NULL;
+                return err;
+            }
+
+            // did the tail list change under us?
+            if (lfs->compact.count == 0) {
+                continue;
+            }
+        }
+
+        lfs->compact.tail[0] = mdir.tail[0];
+        lfs->compact.tail[1] = mdir.tail[1];
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_rawsync_all(lfs_t *lfs) {
+    // flush all files first, this may allocate blocks and must happen
+    // before we reference any of them in metadata
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type != LFS_TYPE_REG
+                || (f->flags & (LFS_F_ERRED | LFS_F_LENT))
+                || !(f->flags & LFS_F_WRITING)) {
+            continue;
+        }
+
+        int err = lfs_file_flush(lfs, f);
+        if (err) {
+            f->flags |= LFS_F_ERRED;
+            return err;
+        }
+    }
+
+    while (true) {
+        // gather dirty files in the same metadata pair as the first dirty
+        // file we find, multiple handles to the same file are left to
+        // later commits so the last one still wins
+        lfs_file_t *batch[LFS_SYNC_BATCH];
+        struct lfs_ctz ctzs[LFS_SYNC_BATCH];
+        struct lfs_mattr attrs[2*LFS_SYNC_BATCH];
+        int count = 0;
+        for (lfs_file_t *f = (lfs_file_t*)lfs->mlist;
+                f && count < LFS_SYNC_BATCH;
+                f = f->next) {
+            if (f->type != LFS_TYPE_REG
+                    || (f->flags & (LFS_F_ERRED | LFS_F_LENT))
+                    || !(f->flags & LFS_F_DIRTY)
+                    || lfs_pair_isnull(f->m.pair)
+                    || (count > 0
+                        && lfs_pair_cmp(f->m.pair, batch[0]->m.pair) != 0)) {
+                continue;
+            }
+
+            bool dup = false;
+            for (int i = 0; i < count; i++) {
+                if (batch[i]->id == f->id) {
+                    dup = true;
+                    break;
                 }
             }
 
-            pdir = dir;
+            if (dup) {
+                continue;
+            }
+
+            lfs_file_syncattrs(lfs, f, &ctzs[count], &attrs[2*count]);
+            batch[count] = f;
+            count += 1;
         }
 
-        pass = moreorphans ? 0 : pass+1;
-    }
+        if (count == 0) {
+            return 0;
+        }
 
-    // mark orphans as fixed
-    return lfs_fs_preporphans(lfs, -lfs_gstate_getorphans(&lfs->gstate));
-}
-#endif
+        lfs_ssize_t used[LFS_SYNC_BATCH];
+        for (int i = 0; i < count; i++) {
+            used[i] = lfs_dir_getused(lfs, &batch[0]->m, batch[i]->id);
+            if (used[i] < 0) {
+                return used[i];
+            }
+        }
 
-#ifndef LFS_READONLY
-static int lfs_fs_forceconsistency(lfs_t *lfs) {
-    int err = lfs_fs_desuperblock(lfs);
-    if (err) {
-        return err;
-    }
+        // commit all of them at once, this clears the erased state of all
+        // but the first file, but each still owns its last block
+        uint32_t erased[LFS_SYNC_BATCH];
+        for (int i = 0; i < count; i++) {
+            erased[i] = batch[i]->flags & LFS_F_ERASED;
+        }
 
-    err = lfs_fs_demove(lfs);
-    if (err) {
-        return err;
-    }
+        int err = lfs_dir_commit(lfs, &batch[0]->m, attrs, 2*count);
+        if (err) {
+            for (int i = 0; i < count; i++) {
+                batch[i]->flags |= LFS_F_ERRED;
+            }
+            return err;
+        }
 
-    err = lfs_fs_deorphan(lfs, true);
-    if (err) {
-        return err;
+        for (int i = 0; i < count; i++) {
+            batch[i]->flags |= erased[i];
+            batch[i]->flags &= ~LFS_F_DIRTY;
+            lfs_file_synced(lfs, batch[i], used[i]);
+        }
     }
-
-    return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-int lfs_fs_rawmkconsistent(lfs_t *lfs) {
-    // lfs_fs_forceconsistency does most of the work here
-    int err = lfs_fs_forceconsistency(lfs);
-    if (err) {
+static int lfs_fs_rawpreerase(lfs_t *lfs, lfs_size_t budget) {
+    if (!lfs->cfg->erase_queue_depth) {
+        return 0;
+    }
+
+    // top up the pool, leaving room for the replacement submitted when
+    // a block is handed out
+    int err = lfs_alloc_erasefill(lfs, lfs->cfg->erase_queue_depth);
+    if (err && err != LFS_ERR_NOSPC) {
         return err;
     }
 
-    // do we have any pending gstate?
-    lfs_gstate_t delta = {0};
-    lfs_gstate_xor(&delta, &lfs->gdisk);
-    lfs_gstate_xor(&delta, &lfs->gstate);
-    if (!lfs_gstate_iszero(&delta)) {
-        // lfs_dir_commit will implicitly write out any pending gstate
-        lfs_mdir_t root;
-        err = lfs_dir_fetch(lfs, &root, lfs->root);
-        if (err) {
-            return err;
+    // and finish erasing, the oldest blocks are erased first
+    while (lfs->equeue.erased < lfs->equeue.count) {
+        if (budget == 0) {
+            return 1;
         }
 
-        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        lfs_size_t i = (lfs->equeue.off + lfs->equeue.erased)
+                % lfs->equeue.size;
+
+        // erase runs of contiguous blocks with one erase_range?
+        if (lfs->cfg->erase_range && !lfs->cfg->erase_submit) {
+            lfs_size_t n = 1;
+            while (n < budget
+                    && lfs->equeue.erased + n < lfs->equeue.count
+                    && lfs->equeue.buffer[(i + n) % lfs->equeue.size]
+                        == lfs->equeue.buffer[i] + n) {
+                n += 1;
+            }
+
+            if (n > 1) {
+                err = lfs_bd_eraserange(lfs, lfs->equeue.buffer[i], n);
+                if (!err) {
+                    lfs->equeue.erased += n;
+                    budget -= n;
+                    continue;
+                } else if (err != LFS_ERR_CORRUPT) {
+                    return err;
+                }
+                // find the bad block one erase at a time
+            }
+        }
+        budget -= 1;
+        err = lfs_bd_erasewait(lfs, lfs->equeue.buffer[i]);
         if (err) {
-            return err;
+            // drop the block from the pool, a bad block is retried
+            // later like any other
+            lfs->equeue.count -= 1;
+            lfs->equeue.buffer[i] = lfs->equeue.buffer[
+                    (lfs->equeue.off + lfs->equeue.count)
+                        % lfs->equeue.size];
+            if (err != LFS_ERR_CORRUPT) {
+                return err;
+            }
+            continue;
         }
+
+        lfs->equeue.erased += 1;
     }
 
     return 0;
@@ -5065,7 +8048,7 @@ static int lfs_fs_size_count(void *p, lfs_block_t block) {
     return 0;
 }
 
-static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
+static lfs_ssize_t lfs_fs_rawsize_exact(lfs_t *lfs) {
     lfs_size_t size = 0;
     int err = lfs_fs_rawtraverse(lfs, lfs_fs_size_count, &size, false);
     if (err) {
@@ -5075,6 +8058,38 @@ static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
     return size;
 }
 
+static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
+    // count blocks once, after this we keep the count up to date
+    if (lfs->used == LFS_BLOCK_NULL) {
+        lfs_ssize_t size = lfs_fs_rawsize_exact(lfs);
+        if (size < 0) {
+            return size;
+        }
+
+#ifndef LFS_READONLY
+        // open files count the blocks they've taken since they were last
+        // synced, rather than what's in their skip-lists
+        lfs_size_t files = 0;
+        int err = lfs_fs_traversefiles(lfs, lfs_fs_size_count, &files);
+        if (err) {
+            return err;
+        }
+
+        size -= files;
+        size += lfs->equeue.count;
+        for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+            if (f->type == LFS_TYPE_REG) {
+                size += f->extent.count + f->extent.taken;
+            }
+        }
+#endif
+
+        lfs->used = size;
+    }
+
+    return lfs->used;
+}
+
 
 #ifdef LFS_MIGRATE
 ////// Migration from littelfs v1 below this //////
@@ -5446,6 +8461,7 @@ static int lfs1_mount(lfs_t *lfs, struct lfs1 *lfs1,
         lfs->free.off = 0;
         lfs->free.size = 0;
         lfs->free.i = 0;
+        lfs->free.extent = 0;
         lfs_alloc_ack(lfs);
 
         // load superblock
@@ -5683,7 +8699,7 @@ static int lfs_rawmigrate(lfs_t *lfs, const struct lfs_config *cfg) {
         dir2.split = true;
 
         lfs_superblock_t superblock = {
-            .version     = LFS_DISK_VERSION,
+            .version     = lfs_fs_disk_version(lfs),
             .block_size  = lfs->cfg->block_size,
             .block_count = lfs->cfg->block_count,
             .name_max    = lfs->name_max,
@@ -5736,6 +8752,53 @@ cleanup:
 #define LFS_UNLOCK(cfg) ((void)cfg)
 #endif
 
+// Clean files that don't live in their metadata pair and already own a
+// cache only touch that cache, so reads of these can share the lock. Taking
+// a cache from the pool may write out another file, and the readahead
+// buffer is shared by all files, so these need the exclusive lock, as do
+// the runtime counters
+static int lfs_file_lockread(lfs_t *lfs, lfs_file_t *file, bool *shared) {
+    *shared = false;
+#if defined(LFS_THREADSAFE) && !defined(LFS_STATS)
+    if (lfs->cfg->lock_shared) {
+        int err = lfs->cfg->lock_shared(lfs->cfg);
+        if (err) {
+            return err;
+        }
+
+        uint32_t flags = LFS_F_INLINE;
+#ifndef LFS_READONLY
+        flags |= LFS_F_WRITING;
+#endif
+        if (!(file->flags & flags) && file->cache.buffer
+                && !lfs->cfg->readahead_size) {
+            *shared = true;
+            return 0;
+        }
+
+        // needs the exclusive lock after all
+        lfs->cfg->unlock_shared(lfs->cfg);
+    }
+#else
+    (void)file;
+#endif
+
+    return LFS_LOCK(lfs->cfg);
+}
+
+static void lfs_file_unlockread(lfs_t *lfs, bool shared) {
+#ifdef LFS_THREADSAFE
+    if (shared) {
+        lfs->cfg->unlock_shared(lfs->cfg);
+        return;
+    }
+#else
+    (void)shared;
+#endif
+
+    LFS_UNLOCK(lfs->cfg);
+}
+
 // Public API
 #ifndef LFS_READONLY
 int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
@@ -5907,6 +8970,54 @@ int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_txn_begin(lfs_t *lfs, lfs_txn_t *txn, const char *path) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_begin(%p, %p, \"%s\")", (void*)lfs, (void*)txn, path);
+
+    err = lfs_txn_rawbegin(lfs, txn, path);
+
+    LFS_TRACE("lfs_txn_begin -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_txn_add(lfs_t *lfs, lfs_txn_t *txn, const struct lfs_txn_op *op) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_add(%p, %p, %p {%"PRIu8", %"PRIu8", \"%s\", "
+                "\"%s\", %p, %"PRIu32"})",
+            (void*)lfs, (void*)txn, (void*)op,
+            op->type, op->attr, op->name, op->newname ? op->newname : "",
+            op->buffer, op->size);
+
+    err = lfs_txn_rawadd(lfs, txn, op);
+
+    LFS_TRACE("lfs_txn_add -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_txn_commit(lfs_t *lfs, lfs_txn_t *txn) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_commit(%p, %p)", (void*)lfs, (void*)txn);
+
+    err = lfs_txn_rawcommit(lfs, txn);
+
+    LFS_TRACE("lfs_txn_commit -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifndef LFS_NO_MALLOC
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file, const char *path, int flags) {
     int err = LFS_LOCK(lfs->cfg);
@@ -5979,7 +9090,8 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
 
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
-    int err = LFS_LOCK(lfs->cfg);
+    bool shared;
+    int err = lfs_file_lockread(lfs, file, &shared);
     if (err) {
         return err;
     }
@@ -5990,6 +9102,73 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
     lfs_ssize_t res = lfs_file_rawread(lfs, file, buffer, size);
 
     LFS_TRACE("lfs_file_read -> %"PRId32, res);
+    lfs_file_unlockread(lfs, shared);
+    return res;
+}
+
+lfs_ssize_t lfs_file_readv(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count) {
+    bool shared;
+    int err = lfs_file_lockread(lfs, file, &shared);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_readv(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, (void*)iov, count);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawreadv(lfs, file, iov, count);
+
+    LFS_TRACE("lfs_file_readv -> %"PRId32, res);
+    lfs_file_unlockread(lfs, shared);
+    return res;
+}
+
+lfs_ssize_t lfs_file_readzc(lfs_t *lfs, lfs_file_t *file,
+        const void **buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_readzc(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, (void*)buffer, size);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawreadzc(lfs, file, buffer, size);
+
+    LFS_TRACE("lfs_file_readzc -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
+int lfs_file_readzc_release(lfs_t *lfs, lfs_file_t *file) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_readzc_release(%p, %p)", (void*)lfs, (void*)file);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    err = lfs_file_rawreadzc_release(lfs, file);
+
+    LFS_TRACE("lfs_file_readzc_release -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+lfs_ssize_t lfs_file_extents(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t off, struct lfs_file_extent *extents, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_extents(%p, %p, %"PRIu32", %p, %"PRIu32")",
+            (void*)lfs, (void*)file, off, (void*)extents, count);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawextents(lfs, file, off, extents, count);
+
+    LFS_TRACE("lfs_file_extents -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
 }
@@ -6011,6 +9190,23 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
     LFS_UNLOCK(lfs->cfg);
     return res;
 }
+
+lfs_ssize_t lfs_file_writev(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_writev(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, (void*)iov, count);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawwritev(lfs, file, iov, count);
+
+    LFS_TRACE("lfs_file_writev -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
 #endif
 
 lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
@@ -6274,6 +9470,20 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     return res;
 }
 
+lfs_ssize_t lfs_fs_size_exact(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_size_exact(%p)", (void*)lfs);
+
+    lfs_ssize_t res = lfs_fs_rawsize_exact(lfs);
+
+    LFS_TRACE("lfs_fs_size_exact -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
 int lfs_dir_path(lfs_t *lfs, lfs_dir_t *dir, char *path, lfs_size_t size) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6319,6 +9529,70 @@ int lfs_fs_mkconsistent(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_fs_gc_step(lfs_t *lfs, lfs_size_t budget) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_gc_step(%p, %"PRIu32")", (void*)lfs, budget);
+
+    err = lfs_fs_rawgc_step(lfs, budget);
+
+    LFS_TRACE("lfs_fs_gc_step -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_compact_step(lfs_t *lfs, lfs_size_t budget) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_compact_step(%p, %"PRIu32")", (void*)lfs, budget);
+
+    err = lfs_fs_rawcompact_step(lfs, budget);
+
+    LFS_TRACE("lfs_fs_compact_step -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_sync_all(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_sync_all(%p)", (void*)lfs);
+
+    err = lfs_fs_rawsync_all(lfs);
+
+    LFS_TRACE("lfs_fs_sync_all -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_preerase(lfs_t *lfs, lfs_size_t budget) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_preerase(%p, %"PRIu32")", (void*)lfs, budget);
+
+    err = lfs_fs_rawpreerase(lfs, budget);
+
+    LFS_TRACE("lfs_fs_preerase -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifdef LFS_MIGRATE
 int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
     int err = LFS_LOCK(cfg);
@@ -28,7 +28,10 @@ extern "C"
 // Version of On-disk data structures
 // Major (top-nibble), incremented on backwards incompatible changes
 // Minor (bottom-nibble), incremented on feature additions
-#define LFS_DISK_VERSION 0x00020001
+//
+// This is the newest version we can mount. Filesystems are only written
+// as lfs2.2 when a feature that needs it is enabled, otherwise as lfs2.1.
+#define LFS_DISK_VERSION 0x00020002
 #define LFS_DISK_VERSION_MAJOR (0xffff & (LFS_DISK_VERSION >> 16))
 #define LFS_DISK_VERSION_MINOR (0xffff & (LFS_DISK_VERSION >>  0))
 
@@ -66,6 +69,12 @@ typedef uint32_t lfs_block_t;
 #define LFS_ATTR_MAX 1022
 #endif
 
+// Maximum number of operations in a transaction, may be redefined. Bounds
+// the stack used by lfs_txn_commit and the size of lfs_txn_t.
+#ifndef LFS_TXN_MAX
+#define LFS_TXN_MAX 8
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -106,6 +115,7 @@ enum lfs_type {
     LFS_TYPE_CREATE         = 0x401,
     LFS_TYPE_DELETE         = 0x4ff,
     LFS_TYPE_SUPERBLOCK     = 0x0ff,
+    LFS_TYPE_CHECKPOINT     = 0x1ff,
     LFS_TYPE_DIRSTRUCT      = 0x200,
     LFS_TYPE_CTZSTRUCT      = 0x202,
     LFS_TYPE_INLINESTRUCT   = 0x201,
@@ -132,6 +142,7 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS_O_LOG    = 0x1000,    // Keep appending to the last block after syncs
 #endif
 
     // internally used flags
@@ -144,6 +155,10 @@ enum lfs_open_flags {
     LFS_F_ERRED   = 0x080000, // An error occurred during write
 #endif
     LFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
+    LFS_F_LENT    = 0x200000, // File cache is lent out by lfs_file_readzc
+#ifndef LFS_READONLY
+    LFS_F_ERASED  = 0x400000, // Rest of the last block is still erased
+#endif
 };
 
 // File seek flags
@@ -153,6 +168,27 @@ enum lfs_whence_flags {
     LFS_SEEK_END = 2,   // Seek relative to the end of the file
 };
 
+// Transaction operation types
+enum lfs_txn_type {
+    LFS_TXN_CREATE     = 1, // Create an empty file, name must not exist
+    LFS_TXN_REMOVE     = 2, // Remove a file
+    LFS_TXN_RENAME     = 3, // Rename an entry, replacing any file at newname
+    LFS_TXN_SETATTR    = 4, // Set a custom attribute
+    LFS_TXN_REMOVEATTR = 5, // Remove a custom attribute
+};
+
+#ifdef LFS_STATS
+// Events reported to the optional event callback
+enum lfs_event {
+    LFS_EVENT_COMPACT_BEGIN  = 1, // Compacting a metadata pair
+    LFS_EVENT_COMPACT_END    = 2,
+    LFS_EVENT_ALLOC_BEGIN    = 3, // Refilling the lookahead buffer
+    LFS_EVENT_ALLOC_END      = 4,
+    LFS_EVENT_DEORPHAN_BEGIN = 5, // Fixing orphans left by a power-loss
+    LFS_EVENT_DEORPHAN_END   = 6,
+};
+#endif
+
 
 // Configuration provided during initialization of the littlefs
 struct lfs_config {
@@ -181,6 +217,43 @@ struct lfs_config {
     // are propagated to the user.
     int (*sync)(const struct lfs_config *c);
 
+    // Optionally start erasing a block without waiting for the erase to
+    // complete. Only used when erase_queue_depth is non-zero, each submitted
+    // erase is waited on with erase_wait before the block is read or
+    // programmed. If NULL, erase is used once the block is needed. Negative
+    // error codes are propagated to the user.
+    int (*erase_submit)(const struct lfs_config *c, lfs_block_t block);
+
+    // Wait for a submitted erase to complete and return its result.
+    // Negative error codes are propagated to the user.
+    // May return LFS_ERR_CORRUPT if the block should be considered bad.
+    int (*erase_wait)(const struct lfs_config *c, lfs_block_t block);
+
+    // Optionally erase count contiguous blocks in one operation. Used by
+    // lfs_fs_preerase on runs of queued blocks when erase_submit is NULL.
+    // Negative error codes are propagated to the user.
+    // May return LFS_ERR_CORRUPT if any of the blocks should be considered
+    // bad, littlefs then erases the blocks one at a time to find out which.
+    int (*erase_range)(const struct lfs_config *c, lfs_block_t block,
+            lfs_size_t count);
+
+    // Optionally program a region larger than cache_size in a block. When
+    // provided, aligned writes that span more than cache_size are programmed
+    // directly from the user's buffer in one operation instead of through
+    // the cache. The size is a multiple of cache_size but may be up to the
+    // block size. Negative error codes are propagated to the user.
+    // May return LFS_ERR_CORRUPT if the block should be considered bad.
+    int (*prog_large)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, const void *buffer, lfs_size_t size);
+
+    // Optional base address of a memory-mapped view of the block device,
+    // block b starting at mmap_base + b*block_size. When provided, reads
+    // copy out of the mapping instead of calling read, lfs_file_readzc
+    // lends out data in place, and lfs_file_extents reports addresses.
+    // Programs and erases must be visible through the mapping once their
+    // callbacks return. If NULL, all reads go through read.
+    const void *mmap_base;
+
 #ifdef LFS_THREADSAFE
     // Lock the underlying block device. Negative error codes
     // are propagated to the user.
@@ -189,6 +262,29 @@ struct lfs_config {
     // Unlock the underlying block device. Negative error codes
     // are propagated to the user.
     int (*unlock)(const struct lfs_config *c);
+
+    // Optionally take and release a shared lock on the underlying block
+    // device. When provided, lfs_file_read and lfs_file_readv on files
+    // with no pending writes, data outside of their metadata pair, and a
+    // cache they already hold, rather than one still to be taken from the
+    // file_cache_count pool, only take the shared lock, so reads of
+    // separate files can run concurrently with each other, though never
+    // with holders of the exclusive lock. Reads always take the exclusive
+    // lock if readahead_size is set, the readahead buffer is shared, and
+    // in LFS_STATS builds, which count every read.
+    // The read callback must then be safe to call from multiple threads,
+    // and a single file handle must still only be used by one thread.
+    // If NULL, all operations take the exclusive lock.
+    int (*lock_shared)(const struct lfs_config *c);
+    int (*unlock_shared)(const struct lfs_config *c);
+#endif
+
+#ifdef LFS_STATS
+    // Optional callback invoked at the beginning and end of operations that
+    // can stall the filesystem, see enum lfs_event. littlefs has no clock,
+    // so the callback is expected to take its own timestamps. The callback
+    // must not call back into littlefs. May be NULL.
+    void (*event)(const struct lfs_config *c, enum lfs_event event);
 #endif
 
     // Minimum size of a block read in bytes. All read operations will be a
@@ -242,6 +338,142 @@ struct lfs_config {
     // allocate this buffer.
     void *lookahead_buffer;
 
+    // Optional statically allocated buffer for the second lookahead window
+    // filled by lfs_fs_gc_step. Must be lookahead_size and aligned to a 32-bit
+    // boundary. By default lfs_malloc is used to allocate this buffer on the
+    // first call to lfs_fs_gc_step.
+    void *gc_lookahead_buffer;
+
+    // Optional granularity in blocks for recording free extents on disk. When
+    // non-zero, allocation scans also measure the run of free blocks that
+    // follows the lookahead window, and this extent is recorded in the
+    // global state committed with every metadata update. The allocator can
+    // then keep allocating from the extent, even across mounts, without
+    // scanning the filesystem again. The recorded extent is moved forward in
+    // steps of this many blocks, so up to this many blocks may go unused
+    // until the next scan after a power-loss.
+    //
+    // Recorded extents need on-disk version lfs2.2, which older drivers
+    // refuse to mount, so enabling this moves the filesystem to lfs2.2 on
+    // the first write. With an older disk_version no extent is recorded.
+    // Mounting with this disabled clears the extent on the next write, but
+    // the filesystem stays at lfs2.2.
+    // Defaults to 0, which disables free extents.
+    lfs_size_t free_extent_step;
+
+    // Optional number of additional read caches. When the read cache is
+    // evicted its contents are kept in a small pool of caches, in least
+    // recently used order, so that reads alternating between a few blocks,
+    // such as metadata lookups and file data, do not go back to disk.
+    // Defaults to 0, which disables the pool.
+    lfs_size_t read_cache_count;
+
+    // Optional statically allocated buffer for the read cache pool. Must be
+    // read_cache_count*(sizeof(lfs_cache_t)+cache_size) and aligned to a
+    // 32-bit boundary. By default lfs_malloc is used to allocate this buffer.
+    void *read_cache_buffer;
+
+    // Optional size in bytes of a RAM index of the names in the most
+    // recently searched directory. The index maps a hash of each name to
+    // the metadata pair and id of its entry, and is kept up to date by
+    // metadata commits, so repeated lookups in a large directory only need
+    // to read the matching entry. Directories that do not fit in the index
+    // fall back to scanning. Defaults to 0, which disables the index.
+    lfs_size_t name_index_size;
+
+    // Optional statically allocated buffer for the name index. Must be
+    // name_index_size and aligned to a 32-bit boundary. By default lfs_malloc
+    // is used to allocate this buffer.
+    void *name_index_buffer;
+
+    // Optional size in bytes of a RAM cache of the decoded tags in the most
+    // recently traversed metadata pair. Each tag takes 8 bytes. Compacting
+    // and committing to a metadata pair traverses its log several times, and
+    // filtering out outdated tags rescans the rest of the log for every tag,
+    // with a cache these scans no longer need to read tags from disk. Logs
+    // that do not fit are cached up to the size of the cache. Defaults to 0,
+    // which disables the cache.
+    lfs_size_t tag_cache_size;
+
+    // Optional statically allocated buffer for the tag cache. Must be
+    // tag_cache_size and aligned to a 32-bit boundary. By default lfs_malloc
+    // is used to allocate this buffer.
+    void *tag_cache_buffer;
+
+    // Optionally write a checkpoint of the global state to the superblock
+    // when unmounting. If the filesystem hasn't been written since, the next
+    // mount reads the global state from the checkpoint instead of fetching
+    // every metadata pair, so mount time no longer grows with the number of
+    // directories. The first write after mounting drops the checkpoint, so
+    // an unclean shutdown falls back to the full scan. This costs a small
+    // commit to the superblock at unmount and on the first write after
+    // mount.
+    //
+    // Checkpoints need on-disk version lfs2.2, which older drivers refuse
+    // to mount, so enabling this moves the filesystem to lfs2.2 on the
+    // first write. With an older disk_version no checkpoint is written.
+    // Defaults to false.
+    bool mount_checkpoint;
+
+    // Optional number of blocks to erase ahead of time while writing files.
+    // Each block handed to a file is replaced in the queue by a newly
+    // allocated block submitted with erase_submit, so the erase of the next
+    // block overlaps with programming the current one. The queue can also
+    // be erased during idle time with lfs_fs_preerase. Queued blocks are
+    // reserved and counted as in use, but are given back to the allocator
+    // when the filesystem is otherwise full. Defaults to 0, which erases
+    // blocks as they are allocated.
+    lfs_size_t erase_queue_depth;
+
+    // Optional statically allocated buffer for the erase queue. Must be
+    // (erase_queue_depth+1)*sizeof(lfs_block_t). By default lfs_malloc is
+    // used to allocate this buffer.
+    void *erase_queue_buffer;
+
+    // Optional number of file caches shared by all open files. Files opened
+    // without their own buffer borrow a cache from this pool when they are
+    // read or written, instead of allocating one for as long as they are
+    // open. When all caches are in use, the cache of another file is taken,
+    // preferring files with nothing to write out. Pending writes are flushed
+    // first, and inline files, which only live in their cache, are synced.
+    // Caches lent out by lfs_file_readzc are never taken, nor are the caches
+    // of removed inline files, and operations fail with LFS_ERR_NOMEM if no
+    // cache can be taken. Unlike with their own cache, inline files removed
+    // while open before they first took a cache read back as empty.
+    // Defaults to 0, which gives each open file its own cache.
+    lfs_size_t file_cache_count;
+
+    // Optional statically allocated buffer for the file cache pool. Must be
+    // file_cache_count*cache_size. By default lfs_malloc is used to allocate
+    // this buffer.
+    void *file_cache_buffer;
+
+    // Optional size of the readahead buffer in bytes. Reads that carry on
+    // from where the file's last read ended are loaded through this buffer
+    // instead of the file's cache, so a sequential pass reads up to
+    // readahead_size bytes of a block with each read call. The buffer is
+    // shared, and belongs to one sequential reader at a time, so reads no
+    // longer take lock_shared. Must be a multiple of the read size and no
+    // larger than the block size. Defaults to 0, which disables readahead.
+    lfs_size_t readahead_size;
+
+    // Optional statically allocated readahead buffer. Must be readahead_size.
+    // By default lfs_malloc is used to allocate this buffer.
+    void *readahead_buffer;
+
+    // Optional size in bytes of a RAM map of directory parents used to fix
+    // orphans after a power-loss. Each directory entry found in the metadata
+    // logs takes 16 bytes. With the map, each pass of lfs_fs_deorphan reads
+    // the metadata list once up front, instead of searching the list for the
+    // parent of every directory. Filesystems that do not fit in the map fall
+    // back to searching. Defaults to 0, which disables the map.
+    lfs_size_t parent_map_size;
+
+    // Optional statically allocated buffer for the parent map. Must be
+    // parent_map_size and aligned to a 32-bit boundary. By default lfs_malloc
+    // is used to allocate this buffer.
+    void *parent_map_buffer;
+
     // Optional upper limit on length of file names in bytes. No downside for
     // larger names except the size of the info struct which is controlled by
     // the LFS_NAME_MAX define. Defaults to LFS_NAME_MAX when zero. Stored in
@@ -264,11 +496,25 @@ struct lfs_config {
     // Defaults to block_size when zero.
     lfs_size_t metadata_max;
 
+    // Optional fill threshold in bytes for metadata pairs compacted by
+    // lfs_fs_compact_step. Pairs with a longer log than this are compacted
+    // ahead of time. Must be <= metadata_max. Defaults to ~88% of
+    // metadata_max when zero.
+    lfs_size_t compact_thresh;
+
+    // Optional upper limit on inlined files in bytes. Inlined files live in
+    // the metadata and save storage, but files that outgrow the limit are
+    // copied out into their own block, so lowering the limit can reduce
+    // write amplification for files that grow past it. Must be <= cache_size,
+    // <= metadata_max/8, and <= 1022. Defaults to the largest
+    // possible inline_max when zero. Set to -1 to disable inline files.
+    lfs_size_t inline_max;
+
 #ifdef LFS_MULTIVERSION
     // On-disk version to use when writing in the form of 16-bit major version
     // + 16-bit minor version. This limiting metadata to what is supported by
     // older minor versions. Note that some features will be lost. Defaults to 
-    // to the most recent minor version when zero.
+    // to the oldest minor version the enabled features need when zero.
     uint32_t disk_version;
 #endif
 };
@@ -288,6 +534,42 @@ struct lfs_info {
     char name[LFS_NAME_MAX+1];
 };
 
+#ifdef LFS_STATS
+// Runtime counters, kept when littlefs is built with LFS_STATS. Counters
+// are reset by lfs_mount and lfs_format and wrap on overflow.
+struct lfs_stats {
+    // Reads served from the read or program caches
+    uint32_t rcache_hits;
+
+    // Reads that went to the block device
+    uint32_t rcache_misses;
+
+    // Programs buffered in the program cache
+    uint32_t pcache_hits;
+
+    // Programs issued to the block device
+    uint32_t pcache_misses;
+
+    // Lookahead buffer refills that traversed the filesystem
+    uint32_t lookahead_refills;
+
+    // Blocks visited by lookahead refill traversals
+    uint32_t lookahead_blocks;
+
+    // Metadata pair compactions
+    uint32_t compacts;
+
+    // Metadata pairs split into a new tail
+    uint32_t splits;
+
+    // Metadata and data blocks relocated because they went bad or wore out
+    uint32_t relocations;
+
+    // Passes over the metadata list looking for orphans
+    uint32_t deorphans;
+};
+#endif
+
 // Filesystem info structure
 struct lfs_fsinfo {
     // On-disk version.
@@ -301,6 +583,11 @@ struct lfs_fsinfo {
 
     // Upper limit on the size of custom attributes in bytes.
     lfs_size_t attr_max;
+
+#ifdef LFS_STATS
+    // Runtime counters since the filesystem was mounted.
+    struct lfs_stats stats;
+#endif
 };
 
 // Custom attribute structure, used to describe custom attributes
@@ -317,10 +604,36 @@ struct lfs_attr {
     lfs_size_t size;
 };
 
+// Buffer segment, used to describe scatter/gather buffers for
+// lfs_file_readv and lfs_file_writev.
+struct lfs_iovec {
+    // Pointer to buffer containing the segment
+    void *buffer;
+
+    // Size of segment in bytes
+    lfs_size_t size;
+};
+
+// On-disk extent of file data, filled in by lfs_file_extents
+struct lfs_file_extent {
+    // Block containing the data
+    lfs_block_t block;
+
+    // Offset of the data in the block
+    lfs_off_t off;
+
+    // Size of the data in bytes
+    lfs_size_t size;
+
+    // Address of the data through mmap_base, NULL if not memory-mapped
+    const void *buffer;
+};
+
 // Optional configuration provided during lfs_file_opencfg
 struct lfs_file_config {
     // Optional statically allocated file buffer. Must be cache_size.
-    // By default lfs_malloc is used to allocate this buffer.
+    // By default lfs_malloc is used to allocate this buffer, or a buffer
+    // is borrowed from the file cache pool if file_cache_count is set.
     void *buffer;
 
     // Optional list of custom attributes related to the file. If the file
@@ -338,6 +651,28 @@ struct lfs_file_config {
 
     // Number of custom attributes in the list
     lfs_size_t attr_count;
+
+    // Optional buffer for caching the file's CTZ skip-list. Blocks found
+    // while seeking are remembered at evenly spaced block indexes, so later
+    // seeks can start from the nearest remembered block instead of the end
+    // of the file. With an entry for every block in the file, any seek needs
+    // at most one pointer hop, smaller buffers space their entries further
+    // apart. Must be aligned to a 32-bit boundary. By default no blocks are
+    // remembered.
+    void *index_buffer;
+
+    // Size of the index buffer in bytes, each entry takes 4 bytes.
+    lfs_size_t index_size;
+
+    // Optional expected size of the file in bytes. When writing a file
+    // expected to grow past its current size, littlefs reserves a run of
+    // contiguous free blocks from the lookahead buffer and allocates the
+    // file's blocks from the run first, so the file can be read back in
+    // large sequential reads. Unused blocks are released when the file is
+    // closed, or when other allocations run out of space. Files expected to
+    // grow past inline_max are also never inlined. By default blocks are
+    // allocated one at a time as they are needed.
+    lfs_size_t size_hint;
 };
 
 
@@ -388,10 +723,45 @@ typedef struct lfs_file {
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    uint8_t ishift;
+
+    struct lfs_extent {
+        lfs_block_t block;
+        lfs_size_t count;
+        lfs_size_t taken;
+    } extent;
 
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
+// A single operation in a transaction, names are entries in the
+// transaction's directory. Any strings and buffers must stay valid until
+// lfs_txn_commit.
+struct lfs_txn_op {
+    // Type of operation, one of lfs_txn_type
+    uint8_t type;
+
+    // 8-bit type of attribute for setattr and removeattr
+    uint8_t attr;
+
+    // Name of the entry
+    const char *name;
+
+    // New name of the entry for rename
+    const char *newname;
+
+    // Attribute for setattr, limited to LFS_ATTR_MAX
+    const void *buffer;
+    lfs_size_t size;
+};
+
+// littlefs transaction type
+typedef struct lfs_txn {
+    const char *path;
+    lfs_size_t count;
+    struct lfs_txn_op ops[LFS_TXN_MAX];
+} lfs_txn_t;
+
 typedef struct lfs_superblock {
     uint32_t version;
     lfs_size_t block_size;
@@ -404,12 +774,15 @@ typedef struct lfs_superblock {
 typedef struct lfs_gstate {
     uint32_t tag;
     lfs_block_t pair[2];
+    lfs_block_t extent[2];
+    uint32_t esum;
 } lfs_gstate_t;
 
 // The littlefs filesystem type
 typedef struct lfs {
     lfs_cache_t rcache;
     lfs_cache_t pcache;
+    lfs_cache_t *rcaches;
 
     lfs_block_t root[2];
     struct lfs_mlist {
@@ -419,6 +792,7 @@ typedef struct lfs {
         lfs_mdir_t m;
     } *mlist;
     uint32_t seed;
+    uint32_t disk_version;
 
     lfs_gstate_t gstate;
     lfs_gstate_t gdisk;
@@ -429,13 +803,70 @@ typedef struct lfs {
         lfs_block_t size;
         lfs_block_t i;
         lfs_block_t ack;
+        lfs_block_t extent;
         uint32_t *buffer;
     } free;
+    lfs_block_t used;
+
+    struct lfs_gc {
+        struct lfs_free free;
+        lfs_block_t tail[2];
+        lfs_block_t count;
+        uint8_t state;
+    } gc;
+
+    struct lfs_compact {
+        lfs_block_t tail[2];
+        lfs_block_t count;
+    } compact;
+
+    struct lfs_nindex {
+        lfs_block_t head[2];
+        lfs_size_t mcount;
+        lfs_size_t count;
+        uint8_t state;
+        uint8_t *buffer;
+    } nindex;
+
+    struct lfs_tcache {
+        lfs_block_t block;
+        lfs_size_t count;
+        uint32_t *buffer;
+    } tcache;
+
+    struct lfs_equeue {
+        lfs_size_t off;
+        lfs_size_t size;
+        lfs_size_t count;
+        lfs_size_t erased;
+        lfs_block_t *buffer;
+    } equeue;
+
+    struct lfs_fcache {
+        lfs_size_t next;
+        uint8_t *buffer;
+    } fcache;
+
+    struct lfs_readahead {
+        const lfs_file_t *file;
+        lfs_cache_t cache;
+    } readahead;
+
+    struct lfs_pmap {
+        lfs_size_t count;
+        uint8_t state;
+        uint32_t *buffer;
+    } pmap;
+
+#ifdef LFS_STATS
+    struct lfs_stats stats;
+#endif
 
     const struct lfs_config *cfg;
     lfs_size_t name_max;
     lfs_size_t file_max;
     lfs_size_t attr_max;
+    lfs_size_t inline_max;
 
 #ifdef LFS_MIGRATE
     struct lfs1 *lfs1;
@@ -535,6 +966,42 @@ int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type);
 #endif
 
 
+/// Transaction operations ///
+
+#ifndef LFS_READONLY
+// Begin a transaction on a directory
+//
+// Operations added to the transaction are applied together by a single
+// atomic commit. A power-loss leaves either all or none of them applied.
+// The path must stay valid until lfs_txn_commit.
+//
+// Returns a negative error code on failure.
+int lfs_txn_begin(lfs_t *lfs, lfs_txn_t *txn, const char *path);
+
+// Add an operation to a transaction
+//
+// The operation is copied into the transaction, but is not checked against
+// the filesystem until lfs_txn_commit. Names must not contain slashes. Up
+// to LFS_TXN_MAX operations can be added.
+//
+// Returns a negative error code on failure.
+int lfs_txn_add(lfs_t *lfs, lfs_txn_t *txn, const struct lfs_txn_op *op);
+
+// Commit a transaction
+//
+// Applies each operation in order as though they were separate calls, but
+// writes them out in a single commit. If any operation fails, nothing is
+// written. Every entry involved must live in the same metadata pair, so
+// this can fail with LFS_ERR_INVAL in large directories. Removing or
+// replacing directories is not supported, and neither is removing an
+// attribute from an existing entry before renaming it in the same
+// transaction, both fail with LFS_ERR_INVAL or LFS_ERR_ISDIR.
+//
+// Returns a negative error code on failure.
+int lfs_txn_commit(lfs_t *lfs, lfs_txn_t *txn);
+#endif
+
+
 /// File operations ///
 
 #ifndef LFS_NO_MALLOC
@@ -576,6 +1043,13 @@ int lfs_file_close(lfs_t *lfs, lfs_file_t *file);
 // Synchronize a file on storage
 //
 // Any pending writes are written out to storage.
+//
+// Normally the next write after a sync copies the partially written last
+// block into a new block. Files opened with LFS_O_LOG instead keep appending
+// to the erased remainder of the last block, as long as the sync left the
+// end of the file prog_size-aligned and the next write starts at the end
+// of the file, as with LFS_O_APPEND.
+//
 // Returns a negative error code on failure.
 int lfs_file_sync(lfs_t *lfs, lfs_file_t *file);
 
@@ -586,6 +1060,47 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file);
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 
+// Read data from file into multiple buffers
+//
+// Takes an array of count buffer segments, which are filled in order. The
+// result is the same as calling lfs_file_read on each segment, but only
+// takes the lock once.
+//
+// Returns the number of bytes read, or a negative error code on failure.
+lfs_ssize_t lfs_file_readv(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count);
+
+// Read data from file without copying
+//
+// Instead of copying into a buffer, points buffer at data in the file's
+// cache, or at the device itself if mmap_base is provided. This may return
+// less than size bytes, even before the end of the file, if the data
+// crosses a cache or block boundary. After any non-zero
+// read, the data stays valid until lfs_file_readzc_release, which must be
+// called before any other operation on the file.
+//
+// Returns the number of bytes read, or a negative error code on failure.
+lfs_ssize_t lfs_file_readzc(lfs_t *lfs, lfs_file_t *file,
+        const void **buffer, lfs_size_t size);
+
+// Release data lent out by lfs_file_readzc
+//
+// Returns a negative error code on failure.
+int lfs_file_readzc_release(lfs_t *lfs, lfs_file_t *file);
+
+// Find where file data lives on disk
+//
+// Fills in up to count extents in file order, starting at offset off. Each
+// extent runs to the end of its block or the file, so every block after the
+// first begins with its skip-list pointers and is never contiguous with the
+// previous extent. Pending writes are flushed first. Inline files have no
+// extents, set inline_max to -1 to keep file data out of metadata.
+//
+// Returns the number of extents filled in, 0 at or past the end of the
+// file, LFS_ERR_INVAL for inline files, or a negative error code on failure.
+lfs_ssize_t lfs_file_extents(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t off, struct lfs_file_extent *extents, lfs_size_t count);
+
 #ifndef LFS_READONLY
 // Write data to file
 //
@@ -595,6 +1110,17 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
 // Returns the number of bytes written, or a negative error code on failure.
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
+
+// Write data to file from multiple buffers
+//
+// Takes an array of count buffer segments, which are written in order. The
+// segments are gathered into the file's cache, so small segments are
+// programmed together. Either all segments fit in the file limit or
+// nothing is written.
+//
+// Returns the number of bytes written, or a negative error code on failure.
+lfs_ssize_t lfs_file_writev(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t count);
 #endif
 
 // Change the position of the file
@@ -720,16 +1246,30 @@ int lfs_dir_path(lfs_t *lfs, lfs_dir_t *dir, char *path, lfs_size_t size);
 // Find on-disk info about the filesystem
 //
 // Fills out the fsinfo structure based on the filesystem found on-disk.
+// When built with LFS_STATS, also fills out the runtime counters.
 // Returns a negative error code on failure.
 int lfs_fs_stat(lfs_t *lfs, struct lfs_fsinfo *fsinfo);
 
 // Finds the current size of the filesystem
 //
+// The count is found by traversing the filesystem once after mounting and
+// kept up to date as blocks are allocated and freed, so this is cheap to
+// poll. Blocks written by open files count as soon as they are allocated,
+// blocks a file no longer needs are returned when it is synced.
+//
+// Returns the number of allocated blocks, or a negative error code on failure.
+lfs_ssize_t lfs_fs_size(lfs_t *lfs);
+
+// Finds the current size of the filesystem by traversing it
+//
+// This is what lfs_fs_size is kept in line with, and can be used to check
+// it. Once all files are closed the two should agree.
+//
 // Note: Result is best effort. If files share COW structures, the returned
 // size may be larger than the filesystem actually is.
 //
 // Returns the number of allocated blocks, or a negative error code on failure.
-lfs_ssize_t lfs_fs_size(lfs_t *lfs);
+lfs_ssize_t lfs_fs_size_exact(lfs_t *lfs);
 
 // Traverse through all blocks in use by the filesystem
 //
@@ -752,6 +1292,73 @@ int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 int lfs_fs_mkconsistent(lfs_t *lfs);
 #endif
 
+#ifndef LFS_READONLY
+// Incrementally prepare the next lookahead window
+//
+// The block allocator needs to traverse the filesystem whenever it runs out
+// of blocks in its lookahead window. This function performs that traversal
+// ahead of time in small, bounded steps, filling a second lookahead window
+// that the allocator switches to once the current window is exhausted. This
+// is intended to be called from an idle task to avoid blocking scans in
+// lfs_file_write and friends.
+//
+// Each call traverses at most budget metadata pairs, including any files
+// they contain. The prepared window is discarded if the current window is
+// replaced or after a rename, in which case the traversal starts over.
+//
+// Returns 1 if more work remains, 0 if the next lookahead window is ready,
+// or a negative error code on failure.
+int lfs_fs_gc_step(lfs_t *lfs, lfs_size_t budget);
+#endif
+
+#ifndef LFS_READONLY
+// Incrementally compact metadata ahead of time
+//
+// Metadata pairs are compacted, and possibly split, by the commit that
+// fills them up, which can make a small update take many times longer than
+// usual. This function walks the metadata pairs in small, bounded steps and
+// compacts any that are filled past compact_thresh or are not erased. This
+// is intended to be called from an idle task so that foreground commits
+// rarely pay for compaction.
+//
+// Each call visits at most budget metadata pairs. The walk starts over if
+// metadata pairs are relocated or removed in the meantime.
+//
+// Returns 1 if more work remains, 0 if all metadata pairs have been
+// visited, or a negative error code on failure.
+int lfs_fs_compact_step(lfs_t *lfs, lfs_size_t budget);
+#endif
+
+#ifndef LFS_READONLY
+// Synchronize all open files on storage
+//
+// Equivalent to calling lfs_file_sync on every open file, except that
+// files in the same metadata pair are committed together, so syncing many
+// files in the same directory only pays for one commit, and possibly one
+// compaction, per directory.
+//
+// Files that already errored or have a cache lent out by lfs_file_readzc
+// are skipped.
+//
+// Returns a negative error code on failure.
+int lfs_fs_sync_all(lfs_t *lfs);
+#endif
+
+#ifndef LFS_READONLY
+// Incrementally erase blocks ahead of time
+//
+// Tops up the erase queue configured with erase_queue_depth and waits for,
+// or with a synchronous block device performs, the erase of at most budget
+// queued blocks. Blocks erased this way are handed to files without waiting
+// on an erase. This is intended to be called from an idle task so file
+// writes don't pay for erases. The pool only lives in RAM, the blocks are
+// still free on disk and are just erased again after a remount.
+//
+// Returns 1 if more work remains, 0 if the pool is ready, or a negative
+// error code on failure.
+int lfs_fs_preerase(lfs_t *lfs, lfs_size_t budget);
+#endif
+
 #ifndef LFS_READONLY
 #ifdef LFS_MIGRATE
 // Attempts to migrate a previous version of littlefs
@@ -212,6 +212,11 @@ static inline uint32_t lfs_tobe32(uint32_t a) {
 }
 
 // Calculate CRC-32 with polynomial = 0x04c11db7
+//
+// By default this uses a small 16-entry table. Define LFS_CRC_SLICE4 or
+// LFS_CRC_SLICE8 to use larger slice-by-4 (4 KiB) or slice-by-8 (8 KiB)
+// tables instead. On ARMv8 targets with the CRC32 extension the hardware
+// instructions are used unless LFS_NO_INTRINSICS is defined.
 uint32_t lfs_crc(uint32_t crc, const void *buffer, size_t size);
 
 // Allocate memory, only used if buffers are not provided to littlefs
@@ -17,6 +17,7 @@
 #include <setjmp.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <execinfo.h>
@@ -561,17 +562,21 @@ static struct lfs_config *bench_cfg = NULL;
 static lfs_emubd_io_t bench_last_readed = 0;
 static lfs_emubd_io_t bench_last_proged = 0;
 static lfs_emubd_io_t bench_last_erased = 0;
+static lfs_emubd_time_t bench_last_time = 0;
 lfs_emubd_io_t bench_readed = 0;
 lfs_emubd_io_t bench_proged = 0;
 lfs_emubd_io_t bench_erased = 0;
+lfs_emubd_time_t bench_time = 0;
 
 void bench_reset(void) {
     bench_readed = 0;
     bench_proged = 0;
     bench_erased = 0;
+    bench_time = 0;
     bench_last_readed = 0;
     bench_last_proged = 0;
     bench_last_erased = 0;
+    bench_last_time = 0;
 }
 
 void bench_start(void) {
@@ -583,9 +588,13 @@ void bench_start(void) {
     lfs_emubd_sio_t erased = lfs_emubd_erased(bench_cfg);
     assert(erased >= 0);
 
+    lfs_emubd_stime_t time = lfs_emubd_time(bench_cfg);
+    assert(time >= 0);
+
     bench_last_readed = readed;
     bench_last_proged = proged;
     bench_last_erased = erased;
+    bench_last_time = time;
 }
 
 void bench_stop(void) {
@@ -597,13 +606,164 @@ void bench_stop(void) {
     lfs_emubd_sio_t erased = lfs_emubd_erased(bench_cfg);
     assert(erased >= 0);
 
+    lfs_emubd_stime_t time = lfs_emubd_time(bench_cfg);
+    assert(time >= 0);
+
     bench_readed += readed - bench_last_readed;
     bench_proged += proged - bench_last_proged;
     bench_erased += erased - bench_last_erased;
+    bench_time += time - bench_last_time;
+}
+
+
+// per-operation recording state
+typedef struct bench_sample {
+    lfs_emubd_io_t readed;
+    lfs_emubd_io_t proged;
+    lfs_emubd_io_t erased;
+    lfs_emubd_time_t time;
+    uint64_t ns;
+} bench_sample_t;
+
+typedef struct bench_op {
+    const char *name;
+    bench_sample_t *samples;
+    size_t sample_count;
+    size_t sample_capacity;
+} bench_op_t;
+
+static bench_op_t *bench_ops = NULL;
+static size_t bench_op_count = 0;
+static size_t bench_op_capacity = 0;
+static bench_sample_t bench_op_last;
+
+static uint64_t bench_ns(void) {
+    struct timespec t;
+    int err = clock_gettime(CLOCK_MONOTONIC, &t);
+    assert(!err);
+    (void)err;
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+static void bench_op_reset(void) {
+    for (size_t i = 0; i < bench_op_count; i++) {
+        free(bench_ops[i].samples);
+    }
+    free(bench_ops);
+    bench_ops = NULL;
+    bench_op_count = 0;
+    bench_op_capacity = 0;
+}
+
+void bench_op_begin(void) {
+    assert(bench_cfg);
+    lfs_emubd_sio_t readed = lfs_emubd_readed(bench_cfg);
+    assert(readed >= 0);
+    lfs_emubd_sio_t proged = lfs_emubd_proged(bench_cfg);
+    assert(proged >= 0);
+    lfs_emubd_sio_t erased = lfs_emubd_erased(bench_cfg);
+    assert(erased >= 0);
+
+    lfs_emubd_stime_t time = lfs_emubd_time(bench_cfg);
+    assert(time >= 0);
+
+    bench_op_last.readed = readed;
+    bench_op_last.proged = proged;
+    bench_op_last.erased = erased;
+    bench_op_last.time = time;
+    bench_op_last.ns = bench_ns();
+}
+
+void bench_op_end(const char *name) {
+    assert(bench_cfg);
+    uint64_t ns = bench_ns();
+    lfs_emubd_sio_t readed = lfs_emubd_readed(bench_cfg);
+    assert(readed >= 0);
+    lfs_emubd_sio_t proged = lfs_emubd_proged(bench_cfg);
+    assert(proged >= 0);
+    lfs_emubd_sio_t erased = lfs_emubd_erased(bench_cfg);
+    assert(erased >= 0);
+    lfs_emubd_stime_t time = lfs_emubd_time(bench_cfg);
+    assert(time >= 0);
+
+    // find our op, there are usually only a handful
+    bench_op_t *op = NULL;
+    for (size_t i = 0; i < bench_op_count; i++) {
+        if (strcmp(bench_ops[i].name, name) == 0) {
+            op = &bench_ops[i];
+            break;
+        }
+    }
+
+    if (!op) {
+        op = mappend((void**)&bench_ops, sizeof(bench_op_t),
+                &bench_op_count, &bench_op_capacity);
+        assert(op);
+        op->name = name;
+        op->samples = NULL;
+        op->sample_count = 0;
+        op->sample_capacity = 0;
+    }
+
+    bench_sample_t *sample = mappend((void**)&op->samples,
+            sizeof(bench_sample_t),
+            &op->sample_count, &op->sample_capacity);
+    assert(sample);
+    sample->readed = readed - bench_op_last.readed;
+    sample->proged = proged - bench_op_last.proged;
+    sample->erased = erased - bench_op_last.erased;
+    sample->time = time - bench_op_last.time;
+    sample->ns = ns - bench_op_last.ns;
+}
+
+static int bench_u64_cmp(const void *a, const void *b) {
+    uint64_t a_ = *(const uint64_t*)a;
+    uint64_t b_ = *(const uint64_t*)b;
+    return (a_ > b_) - (a_ < b_);
+}
+
+// print p50/p99/max of one field of an op's samples
+static void bench_op_printpercentiles(const bench_op_t *op, size_t off) {
+    uint64_t *values = malloc(op->sample_count*sizeof(uint64_t));
+    assert(values);
+    for (size_t i = 0; i < op->sample_count; i++) {
+        values[i] = *(const uint64_t*)(
+                (const uint8_t*)&op->samples[i] + off);
+    }
+    qsort(values, op->sample_count, sizeof(uint64_t), bench_u64_cmp);
+
+    size_t n = op->sample_count;
+    printf(" %"PRIu64" %"PRIu64" %"PRIu64,
+            values[((n-1)*50)/100],
+            values[((n-1)*99)/100],
+            values[n-1]);
+    free(values);
 }
 
 
 // encode our permutation into a reusable id
+static void perm_printid(
+        const struct bench_suite *suite,
+        const struct bench_case *case_);
+
+// report each op recorded with BENCH_OP_BEGIN/BENCH_OP_END
+static void bench_op_report(
+        const struct bench_suite *suite,
+        const struct bench_case *case_) {
+    for (size_t i = 0; i < bench_op_count; i++) {
+        const bench_op_t *op = &bench_ops[i];
+        printf("op ");
+        perm_printid(suite, case_);
+        printf(" %s %zu", op->name, op->sample_count);
+        bench_op_printpercentiles(op, offsetof(bench_sample_t, readed));
+        bench_op_printpercentiles(op, offsetof(bench_sample_t, proged));
+        bench_op_printpercentiles(op, offsetof(bench_sample_t, erased));
+        bench_op_printpercentiles(op, offsetof(bench_sample_t, time));
+        bench_op_printpercentiles(op, offsetof(bench_sample_t, ns));
+        printf("\n");
+    }
+}
+
 static void perm_printid(
         const struct bench_suite *suite,
         const struct bench_case *case_) {
@@ -1314,6 +1474,8 @@ void perm_run(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1321,6 +1483,16 @@ void perm_run(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
     };
 
     struct lfs_emubd_config bdcfg = {
@@ -1331,6 +1503,13 @@ void perm_run(
         .read_sleep         = bench_read_sleep,
         .prog_sleep         = bench_prog_sleep,
         .erase_sleep        = bench_erase_sleep,
+        .read_time          = READ_TIME,
+        .read_bandwidth     = READ_BANDWIDTH,
+        .prog_time          = PROG_TIME,
+        .prog_bandwidth     = PROG_BANDWIDTH,
+        .erase_time         = ERASE_TIME,
+        .erase_suspend      = ERASE_SUSPEND,
+        .suspend_time       = SUSPEND_TIME,
     };
 
     int err = lfs_emubd_createcfg(&cfg, bench_disk_path, &bdcfg);
@@ -1348,12 +1527,16 @@ void perm_run(
 
     case_->run(&cfg);
 
+    bench_op_report(suite, case_);
+    bench_op_reset();
+
     printf("finished ");
     perm_printid(suite, case_);
-    printf(" %"PRIu64" %"PRIu64" %"PRIu64,
+    printf(" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64,
         bench_readed,
         bench_proged,
-        bench_erased);
+        bench_erased,
+        bench_time);
     printf("\n");
 
     // cleanup
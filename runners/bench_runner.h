@@ -26,6 +26,15 @@ void bench_stop(void);
 #define BENCH_START() bench_start()
 #define BENCH_STOP() bench_stop()
 
+// provide BENCH_OP_BEGIN/BENCH_OP_END macros, these record the device ops
+// and wall time of each call separately, so percentiles can be reported per
+// named op
+void bench_op_begin(void);
+void bench_op_end(const char *op);
+
+#define BENCH_OP_BEGIN() bench_op_begin()
+#define BENCH_OP_END(op) bench_op_end(op)
+
 
 // note these are indirectly included in any generated files
 #include "bd/lfs_emubd.h"
@@ -98,6 +107,23 @@ intmax_t bench_define(size_t define);
 #define ERASE_CYCLES_i       8
 #define BADBLOCK_BEHAVIOR_i  9
 #define POWERLOSS_BEHAVIOR_i 10
+#define READ_CACHE_COUNT_i   11
+#define FREE_EXTENT_STEP_i   12
+#define NAME_INDEX_SIZE_i    13
+#define MOUNT_CHECKPOINT_i   14
+#define ERASE_QUEUE_DEPTH_i  15
+#define TAG_CACHE_SIZE_i     16
+#define INLINE_MAX_i         17
+#define FILE_CACHE_COUNT_i   18
+#define READAHEAD_SIZE_i     19
+#define PARENT_MAP_SIZE_i    20
+#define READ_TIME_i          21
+#define READ_BANDWIDTH_i     22
+#define PROG_TIME_i          23
+#define PROG_BANDWIDTH_i     24
+#define ERASE_TIME_i         25
+#define ERASE_SUSPEND_i      26
+#define SUSPEND_TIME_i       27
 
 #define READ_SIZE           bench_define(READ_SIZE_i)
 #define PROG_SIZE           bench_define(PROG_SIZE_i)
@@ -110,6 +136,23 @@ intmax_t bench_define(size_t define);
 #define ERASE_CYCLES        bench_define(ERASE_CYCLES_i)
 #define BADBLOCK_BEHAVIOR   bench_define(BADBLOCK_BEHAVIOR_i)
 #define POWERLOSS_BEHAVIOR  bench_define(POWERLOSS_BEHAVIOR_i)
+#define READ_CACHE_COUNT    bench_define(READ_CACHE_COUNT_i)
+#define FREE_EXTENT_STEP    bench_define(FREE_EXTENT_STEP_i)
+#define NAME_INDEX_SIZE     bench_define(NAME_INDEX_SIZE_i)
+#define MOUNT_CHECKPOINT    bench_define(MOUNT_CHECKPOINT_i)
+#define ERASE_QUEUE_DEPTH   bench_define(ERASE_QUEUE_DEPTH_i)
+#define TAG_CACHE_SIZE      bench_define(TAG_CACHE_SIZE_i)
+#define INLINE_MAX          bench_define(INLINE_MAX_i)
+#define FILE_CACHE_COUNT    bench_define(FILE_CACHE_COUNT_i)
+#define READAHEAD_SIZE      bench_define(READAHEAD_SIZE_i)
+#define PARENT_MAP_SIZE     bench_define(PARENT_MAP_SIZE_i)
+#define READ_TIME           bench_define(READ_TIME_i)
+#define READ_BANDWIDTH      bench_define(READ_BANDWIDTH_i)
+#define PROG_TIME           bench_define(PROG_TIME_i)
+#define PROG_BANDWIDTH      bench_define(PROG_BANDWIDTH_i)
+#define ERASE_TIME          bench_define(ERASE_TIME_i)
+#define ERASE_SUSPEND       bench_define(ERASE_SUSPEND_i)
+#define SUSPEND_TIME        bench_define(SUSPEND_TIME_i)
 
 #define BENCH_IMPLICIT_DEFINES \
     BENCH_DEF(READ_SIZE,          PROG_SIZE) \
@@ -122,10 +165,27 @@ intmax_t bench_define(size_t define);
     BENCH_DEF(ERASE_VALUE,        0xff) \
     BENCH_DEF(ERASE_CYCLES,       0) \
     BENCH_DEF(BADBLOCK_BEHAVIOR,  LFS_EMUBD_BADBLOCK_PROGERROR) \
-    BENCH_DEF(POWERLOSS_BEHAVIOR, LFS_EMUBD_POWERLOSS_NOOP)
+    BENCH_DEF(POWERLOSS_BEHAVIOR, LFS_EMUBD_POWERLOSS_NOOP) \
+    BENCH_DEF(READ_CACHE_COUNT,   0) \
+    BENCH_DEF(FREE_EXTENT_STEP,   0) \
+    BENCH_DEF(NAME_INDEX_SIZE,    0) \
+    BENCH_DEF(MOUNT_CHECKPOINT,   0) \
+    BENCH_DEF(ERASE_QUEUE_DEPTH,  0) \
+    BENCH_DEF(TAG_CACHE_SIZE,     0) \
+    BENCH_DEF(INLINE_MAX,         0) \
+    BENCH_DEF(FILE_CACHE_COUNT,   0) \
+    BENCH_DEF(READAHEAD_SIZE,     0) \
+    BENCH_DEF(PARENT_MAP_SIZE,    0) \
+    BENCH_DEF(READ_TIME,          0) \
+    BENCH_DEF(READ_BANDWIDTH,     0) \
+    BENCH_DEF(PROG_TIME,          0) \
+    BENCH_DEF(PROG_BANDWIDTH,     0) \
+    BENCH_DEF(ERASE_TIME,         0) \
+    BENCH_DEF(ERASE_SUSPEND,      0) \
+    BENCH_DEF(SUSPEND_TIME,       0)
 
 #define BENCH_GEOMETRY_DEFINE_COUNT 4
-#define BENCH_IMPLICIT_DEFINE_COUNT 11
+#define BENCH_IMPLICIT_DEFINE_COUNT 28
 
 
 #endif
@@ -1319,6 +1319,20 @@ static void list_geometries(void) {
 }
 
 
+// the runner is single-threaded, but LFS_THREADSAFE builds still need lock
+// callbacks, tests that care about locking install their own
+#ifdef LFS_THREADSAFE
+static int test_lock(const struct lfs_config *cfg) {
+    (void)cfg;
+    return 0;
+}
+
+static int test_unlock(const struct lfs_config *cfg) {
+    (void)cfg;
+    return 0;
+}
+#endif
+
 // scenarios to run tests under power-loss
 
 static void run_powerloss_none(
@@ -1339,6 +1353,8 @@ static void run_powerloss_none(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1346,6 +1362,20 @@ static void run_powerloss_none(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
+    #ifdef LFS_THREADSAFE
+        .lock               = test_lock,
+        .unlock             = test_unlock,
+    #endif
     #ifdef LFS_MULTIVERSION
         .disk_version       = DISK_VERSION,
     #endif
@@ -1411,6 +1441,8 @@ static void run_powerloss_linear(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1418,6 +1450,20 @@ static void run_powerloss_linear(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
+    #ifdef LFS_THREADSAFE
+        .lock               = test_lock,
+        .unlock             = test_unlock,
+    #endif
     #ifdef LFS_MULTIVERSION
         .disk_version       = DISK_VERSION,
     #endif
@@ -1500,6 +1546,8 @@ static void run_powerloss_log(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1507,6 +1555,20 @@ static void run_powerloss_log(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
+    #ifdef LFS_THREADSAFE
+        .lock               = test_lock,
+        .unlock             = test_unlock,
+    #endif
     #ifdef LFS_MULTIVERSION
         .disk_version       = DISK_VERSION,
     #endif
@@ -1587,6 +1649,8 @@ static void run_powerloss_cycles(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1594,6 +1658,20 @@ static void run_powerloss_cycles(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
+    #ifdef LFS_THREADSAFE
+        .lock               = test_lock,
+        .unlock             = test_unlock,
+    #endif
     #ifdef LFS_MULTIVERSION
         .disk_version       = DISK_VERSION,
     #endif
@@ -1772,6 +1850,8 @@ static void run_powerloss_exhaustive(
         .prog               = lfs_emubd_prog,
         .erase              = lfs_emubd_erase,
         .sync               = lfs_emubd_sync,
+        .erase_submit       = lfs_emubd_erase_submit,
+        .erase_wait         = lfs_emubd_erase_wait,
         .read_size          = READ_SIZE,
         .prog_size          = PROG_SIZE,
         .block_size         = BLOCK_SIZE,
@@ -1779,6 +1859,20 @@ static void run_powerloss_exhaustive(
         .block_cycles       = BLOCK_CYCLES,
         .cache_size         = CACHE_SIZE,
         .lookahead_size     = LOOKAHEAD_SIZE,
+        .read_cache_count   = READ_CACHE_COUNT,
+        .free_extent_step   = FREE_EXTENT_STEP,
+        .name_index_size    = NAME_INDEX_SIZE,
+        .mount_checkpoint   = MOUNT_CHECKPOINT,
+        .erase_queue_depth  = ERASE_QUEUE_DEPTH,
+        .tag_cache_size     = TAG_CACHE_SIZE,
+        .inline_max         = INLINE_MAX,
+        .file_cache_count   = FILE_CACHE_COUNT,
+        .readahead_size     = READAHEAD_SIZE,
+        .parent_map_size    = PARENT_MAP_SIZE,
+    #ifdef LFS_THREADSAFE
+        .lock               = test_lock,
+        .unlock             = test_unlock,
+    #endif
     #ifdef LFS_MULTIVERSION
         .disk_version       = DISK_VERSION,
     #endif
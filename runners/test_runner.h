@@ -92,6 +92,16 @@ intmax_t test_define(size_t define);
 #define BADBLOCK_BEHAVIOR_i  9
 #define POWERLOSS_BEHAVIOR_i 10
 #define DISK_VERSION_i       11
+#define READ_CACHE_COUNT_i   12
+#define FREE_EXTENT_STEP_i   13
+#define NAME_INDEX_SIZE_i    14
+#define MOUNT_CHECKPOINT_i   15
+#define ERASE_QUEUE_DEPTH_i  16
+#define TAG_CACHE_SIZE_i     17
+#define INLINE_MAX_i         18
+#define FILE_CACHE_COUNT_i   19
+#define READAHEAD_SIZE_i     20
+#define PARENT_MAP_SIZE_i    21
 
 #define READ_SIZE           TEST_DEFINE(READ_SIZE_i)
 #define PROG_SIZE           TEST_DEFINE(PROG_SIZE_i)
@@ -105,6 +115,16 @@ intmax_t test_define(size_t define);
 #define BADBLOCK_BEHAVIOR   TEST_DEFINE(BADBLOCK_BEHAVIOR_i)
 #define POWERLOSS_BEHAVIOR  TEST_DEFINE(POWERLOSS_BEHAVIOR_i)
 #define DISK_VERSION        TEST_DEFINE(DISK_VERSION_i)
+#define READ_CACHE_COUNT    TEST_DEFINE(READ_CACHE_COUNT_i)
+#define FREE_EXTENT_STEP    TEST_DEFINE(FREE_EXTENT_STEP_i)
+#define NAME_INDEX_SIZE     TEST_DEFINE(NAME_INDEX_SIZE_i)
+#define MOUNT_CHECKPOINT    TEST_DEFINE(MOUNT_CHECKPOINT_i)
+#define ERASE_QUEUE_DEPTH   TEST_DEFINE(ERASE_QUEUE_DEPTH_i)
+#define TAG_CACHE_SIZE      TEST_DEFINE(TAG_CACHE_SIZE_i)
+#define INLINE_MAX          TEST_DEFINE(INLINE_MAX_i)
+#define FILE_CACHE_COUNT    TEST_DEFINE(FILE_CACHE_COUNT_i)
+#define READAHEAD_SIZE      TEST_DEFINE(READAHEAD_SIZE_i)
+#define PARENT_MAP_SIZE     TEST_DEFINE(PARENT_MAP_SIZE_i)
 
 #define TEST_IMPLICIT_DEFINES \
     TEST_DEF(READ_SIZE,          PROG_SIZE) \
@@ -118,10 +138,33 @@ intmax_t test_define(size_t define);
     TEST_DEF(ERASE_CYCLES,       0) \
     TEST_DEF(BADBLOCK_BEHAVIOR,  LFS_EMUBD_BADBLOCK_PROGERROR) \
     TEST_DEF(POWERLOSS_BEHAVIOR, LFS_EMUBD_POWERLOSS_NOOP) \
-    TEST_DEF(DISK_VERSION,       0)
-
-#define TEST_IMPLICIT_DEFINE_COUNT 12
+    TEST_DEF(DISK_VERSION,       0) \
+    TEST_DEF(READ_CACHE_COUNT,   0) \
+    TEST_DEF(FREE_EXTENT_STEP,   0) \
+    TEST_DEF(NAME_INDEX_SIZE,    0) \
+    TEST_DEF(MOUNT_CHECKPOINT,   0) \
+    TEST_DEF(ERASE_QUEUE_DEPTH,  0) \
+    TEST_DEF(TAG_CACHE_SIZE,     0) \
+    TEST_DEF(INLINE_MAX,         0) \
+    TEST_DEF(FILE_CACHE_COUNT,   0) \
+    TEST_DEF(READAHEAD_SIZE,     0) \
+    TEST_DEF(PARENT_MAP_SIZE,    0)
+
+#define TEST_IMPLICIT_DEFINE_COUNT 22
 #define TEST_GEOMETRY_DEFINE_COUNT 4
 
+// optional build features, so tests that need them can be filtered with if
+#ifdef LFS_THREADSAFE
+#define TEST_THREADSAFE 1
+#else
+#define TEST_THREADSAFE 0
+#endif
+
+#ifdef LFS_STATS
+#define TEST_STATS 1
+#else
+#define TEST_STATS 0
+#endif
+
 
 #endif
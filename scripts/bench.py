@@ -763,6 +763,7 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
     readed = 0
     proged = 0
     erased = 0
+    simulated = 0
     failures = []
     killed = False
 
@@ -772,6 +773,11 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
                 '(?: (?P<readed>\d+))?'
                 '(?: (?P<proged>\d+))?'
                 '(?: (?P<erased>\d+))?'
+                '(?: (?P<time>\d+))?'
+            '|' '(?P<op__>op) [^\s]+'
+                ' (?P<op_name>[^\s]+)'
+                ' (?P<op_count>\d+)'
+                ' (?P<op_stats>\d+(?: \d+){14})'
             '|' '(?P<path>[^:]+):(?P<lineno>\d+):(?P<op_>assert):'
                 ' *(?P<message>.*)'
         ')$')
@@ -785,6 +791,7 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
         nonlocal readed
         nonlocal proged
         nonlocal erased
+        nonlocal simulated
         nonlocal locals
 
         # run the benches!
@@ -801,6 +808,7 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
         last_id = None
         last_stdout = co.deque(maxlen=args.get('context', 5) + 1)
         last_assert = None
+        last_ops = []
         try:
             while True:
                 # parse a line for state changes
@@ -822,24 +830,41 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
 
                 m = pattern.match(line)
                 if m:
-                    op = m.group('op') or m.group('op_')
+                    op = m.group('op') or m.group('op_') or m.group('op__')
                     if op == 'running':
                         locals.seen_perms += 1
                         last_id = m.group('id')
                         last_stdout.clear()
                         last_assert = None
+                        last_ops = []
+                    elif op == 'op':
+                        # per-op percentiles, written out when we finish
+                        stats = [int(v) for v in m.group('op_stats').split()]
+                        last_ops.append({
+                            'bench_op': m.group('op_name'),
+                            'bench_op_count': int(m.group('op_count')),
+                            **{'bench_op_%s_%s' % (field, stat): v
+                                for (field, stat), v in zip(
+                                    ((field, stat)
+                                        for field in [
+                                            'readed', 'proged',
+                                            'erased', 'time', 'ns']
+                                        for stat in ['p50', 'p99', 'max']),
+                                    stats)}})
                     elif op == 'finished':
                         case = m.group('case')
                         suite = case_suites[case]
                         readed_ = int(m.group('readed'))
                         proged_ = int(m.group('proged'))
                         erased_ = int(m.group('erased'))
+                        simulated_ = int(m.group('time') or 0)
                         passed_suite_perms[suite] += 1
                         passed_case_perms[case] += 1
                         passed_perms += 1
                         readed += readed_
                         proged += proged_
                         erased += erased_
+                        simulated += simulated_
                         if output_:
                             # get defines and write to csv
                             defines = find_defines(
@@ -850,7 +875,15 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
                                 'bench_readed': readed_,
                                 'bench_proged': proged_,
                                 'bench_erased': erased_,
+                                'bench_time': simulated_,
                                 **defines})
+                            # one row per recorded op
+                            for op_ in last_ops:
+                                output_.writerow({
+                                    'suite': suite,
+                                    'case': case,
+                                    **op_,
+                                    **defines})
                     elif op == 'skipped':
                         locals.seen_perms += 1
                     elif op == 'assert':
@@ -993,6 +1026,7 @@ def run_stage(name, runner_, ids, stdout_, trace_, output_, **args):
         readed,
         proged,
         erased,
+        simulated,
         failures,
         killed)
 
@@ -1028,7 +1062,7 @@ def run(runner, bench_ids=[], **args):
     if args.get('output'):
         output = BenchOutput(args['output'],
             ['suite', 'case'],
-            ['bench_readed', 'bench_proged', 'bench_erased'])
+            ['bench_readed', 'bench_proged', 'bench_erased', 'bench_time'])
 
     # measure runtime
     start = time.time()
@@ -1039,6 +1073,7 @@ def run(runner, bench_ids=[], **args):
     readed = 0
     proged = 0
     erased = 0
+    simulated = 0
     failures = []
     for by in (bench_ids if bench_ids
             else expected_case_perms.keys() if args.get('by_cases')
@@ -1050,6 +1085,7 @@ def run(runner, bench_ids=[], **args):
             readed_,
             proged_,
             erased_,
+            simulated_,
             failures_,
             killed) = run_stage(
                 by or 'benches',
@@ -1065,6 +1101,7 @@ def run(runner, bench_ids=[], **args):
         readed += readed_
         proged += proged_
         erased += erased_
+        simulated += simulated_
         failures.extend(failures_)
         if (failures and not args.get('keep_going')) or killed:
             break
@@ -1094,6 +1131,7 @@ def run(runner, bench_ids=[], **args):
             '%d readed' % readed,
             '%d proged' % proged,
             '%d erased' % erased,
+            '%.2fs simulated' % (simulated/1.0e9) if simulated else None,
             'in %.2fs' % (stop-start)]))))
     print()
 